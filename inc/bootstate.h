@@ -0,0 +1,103 @@
+// Program slots and boot state
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _BOOTSTATE_H
+#define _BOOTSTATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// There are two program slots, A in flash sectors 4-5 and B in 6-7, each
+// with the program linked to run there.  The loader programs a new image
+// into the slot that isn't running, and boots it on trial; the program
+// confirms once it's up, and that makes it the active slot.  If it
+// doesn't, within a few boots, the loader goes back to the other.
+//
+// What's where is kept as a log of records in flash sector 2 or 3 (past
+// the loader), appended to as things happen and replayed to find the
+// current state.  When it fills, the state is written compactly into the
+// other sector, and only then marked valid, by a first record with the
+// next sequence number; so a reset at any point leaves one whole copy.
+// A log with no such record (as older loaders wrote) counts as number 0.
+//
+// Compacting erases a sector, which stalls flash for a good while.  The
+// loader leaves room for the record the program appends, so that only
+// ever happens in the loader.
+
+#define NUM_SLOTS 2
+#define SLOT_BYTES (192*1024)
+#define SLOT_ADDR(s) ((s) ? 0x08040000 : 0x08010000)
+#define NO_SLOT 0xff
+
+#define NUM_LOGS 2
+#define BOOTSTATE_ADDR 0x08008000
+#define BOOTSTATE_BYTES (16*1024)	// Each
+
+#define BOOTREC_MAGIC 0x52424c4f	/* "OLBR" */
+
+enum bootrec_type {
+	BOOTREC_IMAGE = 1,	// Slot holds this image (fingerprint, size, crc)
+	BOOTREC_TRIAL,		// Boot slot on trial
+	BOOTREC_ATTEMPT,	// Trial boot started
+	BOOTREC_CONFIRM,	// Program in slot came up; it's active
+	BOOTREC_REVERT,		// Trial failed; don't use slot
+	BOOTREC_BEGIN,		// First in a log; fingerprint is its number
+};
+
+struct bootrec {
+	uint32_t magic;
+	uint8_t type;
+	uint8_t slot;
+	uint16_t reserved;
+	uint32_t fingerprint;	// Of the lager.bin it came from
+	uint32_t size;
+	uint32_t crc;
+	uint32_t pad[3];
+};
+
+struct boot_slot {
+	bool known;		// Image recorded
+	bool failed;		// Trial failed
+	uint32_t fingerprint;
+	uint32_t size;
+	uint32_t crc;
+};
+
+struct boot_state {
+	struct boot_slot slots[NUM_SLOTS];
+	uint8_t active;
+	uint8_t trial;		// NO_SLOT if none
+	uint8_t attempts;	// Trial boots so far
+	uint8_t log;		// Which sector has the current log
+	uint32_t seq;		// Its number
+	unsigned int used;	// Records in the log
+};
+
+void bootstate_load(struct boot_state *state);
+void bootstate_append(struct boot_state *state, enum bootrec_type type,
+		uint8_t slot);
+void bootstate_reserve(struct boot_state *state, unsigned int recs);
+
+#endif /* _BOOTSTATE_H */
@@ -0,0 +1,83 @@
+// Streaming config file parser
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _CFGPARSE_H
+#define _CFGPARSE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// lager.cfg is one flat JSON object of keys and values.  This reads it a
+// piece at a time, so the file can be any size, and hands each key and
+// its value to a callback.  Values are passed as the raw text (escapes
+// and all) like jsmn did.  Objects and arrays are skipped over and passed
+// as CFG_VAL_NESTED, with no text.
+
+#define CFG_KEY_MAX 32
+#define CFG_VAL_MAX 128
+
+enum cfg_val_type {
+	CFG_VAL_STRING,
+	CFG_VAL_PRIMITIVE,
+	CFG_VAL_NESTED,
+};
+
+struct cfg_value {
+	enum cfg_val_type type;
+	const char *text;
+	unsigned int len;	// Strings are cut to CFG_VAL_MAX
+	uint32_t key_pos;	// File offset of the key's first character
+};
+
+// len is the key's full length, even if longer than CFG_KEY_MAX, so it
+// can't match a shorter name by accident.
+typedef void (*cfg_handler_t)(const char *key, unsigned int len,
+		const struct cfg_value *val);
+
+struct cfg_parser {
+	cfg_handler_t handler;
+
+	uint32_t pos;
+	uint32_t key_pos;
+
+	uint8_t state;
+	uint8_t depth;		// Of the nested value being skipped
+	bool escape;
+	bool nested_str;
+
+	unsigned int key_len;
+	unsigned int val_len;
+
+	char key[CFG_KEY_MAX];
+	char val[CFG_VAL_MAX];
+};
+
+void cfgparse_init(struct cfg_parser *p, cfg_handler_t handler);
+
+// Both return nonzero if the file isn't a valid config.
+int cfgparse_feed(struct cfg_parser *p, const char *buf, unsigned int len);
+int cfgparse_finish(struct cfg_parser *p);
+
+#endif // _CFGPARSE_H
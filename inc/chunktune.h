@@ -0,0 +1,56 @@
+// Adaptive receive chunk sizing
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _CHUNKTUNE_H
+#define _CHUNKTUNE_H
+
+#include <stdint.h>
+
+// Picks usart_receive_chunk's timeout and chunk limits from the measured
+// input rate and card write time.  When writes are slow, it gathers more
+// data per write, so per-write overhead is amortized; when the card keeps
+// up easily, it writes smaller chunks sooner, so less data is waiting in
+// RAM.  A backlog is allowed to go out in large chunks to catch up.
+//
+// Plain C with no hardware dependencies, so misc/chunksim.cpp can drive
+// it against synthetic card latency profiles.
+
+struct chunk_tune {
+	unsigned int buf_len;
+
+	uint32_t rate;		// Input, bytes/s, smoothed
+	uint32_t write_us;	// Recent worst write time, decaying
+
+	// Outputs, for usart_receive_chunk
+	uint32_t timeout_us;
+	unsigned int min_chunk;
+	unsigned int max_chunk;
+};
+
+void chunk_tune_init(struct chunk_tune *t, unsigned int buf_len);
+void chunk_tune_update(struct chunk_tune *t, unsigned int bytes,
+		uint32_t elapsed_us, uint32_t write_us, unsigned int backlog);
+
+#endif // _CHUNKTUNE_H
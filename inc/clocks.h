@@ -0,0 +1,60 @@
+// Clock profiles
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _CLOCKS_H
+#define _CLOCKS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// A profile sets limits on the core clock and the SDIO kernel clock
+// (PLL48CLK; the card gets half).  Both come from the one PLL, so they
+// can't always both be at their limit; clocks_setup works out the PLL
+// settings that get the core as fast as allowed, then SDIO, while
+// keeping the USART within CLOCK_BAUD_TOLERANCE of the requested baud.
+// Flash wait states, the ART accelerator and the regulator's voltage
+// scale are set to match.
+
+struct clock_profile {
+	const char *name;
+	uint32_t max_core_hz;
+	uint32_t max_sdio_hz;
+};
+
+#define CLOCK_PROFILE_STANDARD 0
+
+extern const struct clock_profile clock_profiles[];
+extern const unsigned int num_clock_profiles;
+
+// What's running now
+extern uint32_t clocks_core_hz;
+extern uint32_t clocks_sdio_hz;
+
+int clocks_find_profile(const char *name, unsigned int len);
+bool clocks_setup(unsigned int profile, uint32_t baud);
+unsigned int clocks_max_divider(uint32_t baud);
+void clocks_set_divider(unsigned int div);
+
+#endif /* _CLOCKS_H */
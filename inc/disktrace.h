@@ -0,0 +1,71 @@
+// Storage operation traces
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _DISKTRACE_H
+#define _DISKTRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// With tracing on, disk_read and disk_write each append a record of what
+// they did and how long it took, so a card's stall behaviour can be
+// captured in the field and replayed off-target by misc/lagerreplay.
+// traceDisk saves the records to trace.bin: a disk_trace_hdr, then
+// disk_trace_rec entries.
+
+#define DISK_TRACE_MAGIC 0x52544c4f	/* "OLTR" */
+
+struct disk_trace_hdr {
+	uint32_t magic;
+	uint16_t rec_size;
+	uint16_t cycles_per_us;		// Clock the durations are counted in
+					// (1, for the 1MHz timebase)
+};
+
+#define DISK_TRACE_WRITE	0x0001	// Else a read
+#define DISK_TRACE_RETRIED	0x0002	// Some transaction was retried
+#define DISK_TRACE_FAILED	0x0004	// Gave up; returned an error
+#define DISK_TRACE_LOST		0x8000	// Records dropped here; count in lba
+
+struct disk_trace_rec {
+	uint32_t lba;
+	uint16_t sectors;
+	uint16_t flags;
+	uint32_t cycles;	// Duration; see cycles_per_us
+};
+
+// Starts recording into buf, from its beginning.  If records were dropped
+// since the last start because buf was full, a DISK_TRACE_LOST record
+// comes first.  A NULL buf stops tracing.
+void disk_trace_start(struct disk_trace_rec *buf, unsigned int len);
+
+// Stops recording, so buf can be saved without the saving being traced.
+// Returns the number of records in it.
+unsigned int disk_trace_stop(void);
+
+// Whether the trace buffer's full and records are being dropped.
+bool disk_trace_full(void);
+
+#endif /* _DISKTRACE_H */
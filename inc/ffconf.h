@@ -35,7 +35,7 @@
 /* This option switches filtered directory read functions, f_findfirst() and
 /  f_findnext(). (0:Disable, 1:Enable 2:Enable with matching altname[] too) */
 
-#define _USE_MKFS               0
+#define _USE_MKFS               1
 /* This option switches f_mkfs() function. (0:Disable or 1:Enable) */
 
 #define _USE_FASTSEEK   0
@@ -216,6 +216,14 @@
 /      can be opened simultaneously under file lock control. Note that the file
 /      lock control is independent of re-entrancy. */
 
+#define _FS_FREEIDX     32
+/* The option _FS_FREEIDX sets how many free cluster extents f_buildidx() keeps
+/  in RAM, so that f_expand() and cluster allocation can find free space without
+/  scanning the FAT one entry at a time. Only the largest extents are kept, and
+/  clusters freed after the index is built are not added back to it, so both fall
+/  back to the FAT scan when the index has nothing suitable. FAT16/32 only.
+/  Each extent costs 8 bytes in the file system object. (0:Disable) */
+
 #define _FS_REENTRANT   0
 #define _FS_TIMEOUT             1000
 #define _SYNC_t                 HANDLE
@@ -0,0 +1,58 @@
+// Loader to application handoff
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _HANDOFF_H
+#define _HANDOFF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sdio.h>
+
+#define HANDOFF_MAGIC 0x4f484c4f	/* "OLHO" */
+
+// State the loader leaves in RAM for the application, so it needn't
+// redo the card's setup, and so it knows whether it's on trial.  It's
+// in the .handoff section, at the start of RAM in both programs and
+// never cleared by startup code, so it's only valid when handoff_valid
+// says so.  The application invalidates it once read.
+
+#define HANDOFF_CARD 1		// card is set up and selected
+#define HANDOFF_TRIAL 2		// Must confirm it came up; see bootstate.h
+
+struct handoff {
+	uint32_t magic;
+	uint32_t flags;
+	uint32_t slot;			// Program slot being run
+	struct sd_card_state card;	// Card left selected
+	uint32_t check;
+};
+
+extern struct handoff boot_handoff;
+
+void handoff_seal(struct handoff *h);
+bool handoff_valid(const struct handoff *h);
+
+#endif /* _HANDOFF_H */
@@ -0,0 +1,49 @@
+// Program image header
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _IMAGEHDR_H
+#define _IMAGEHDR_H
+
+#include <stdint.h>
+
+// lager.bin on the card is one or more of these headers, each followed
+// by a program image linked to run at addr-- one per program slot (see
+// inc/bootstate.h).  Only the image is programmed; the loader keeps the
+// size and CRC alongside, so it can tell from the header alone whether
+// an image is already there, and check what's programmed before running
+// it.  misc/lagerimg adds the headers to what the linker produces,
+// trimming off the trailing padding.
+
+#define IMAGE_HDR_MAGIC 0x474d4c4f	/* "OLMG" */
+
+struct image_hdr {
+	uint32_t magic;
+	uint32_t addr;		// Where it's linked to run
+	uint32_t size;		// Bytes of image; a multiple of 4
+	uint32_t crc;		// STM32 CRC unit over the image's words
+	uint32_t check;		// ~(magic ^ addr ^ size ^ crc)
+};
+
+#endif /* _IMAGEHDR_H */
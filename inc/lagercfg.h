@@ -9,7 +9,14 @@ unsigned char lager_cfg[] = {
   0x6c, 0x6c, 0x6f, 0x63, 0x42, 0x79, 0x74, 0x65, 0x73, 0x22, 0x20, 0x3a,
   0x20, 0x31, 0x30, 0x34, 0x38, 0x35, 0x37, 0x36, 0x30, 0x30, 0x2c, 0x0a,
   0x09, 0x22, 0x70, 0x72, 0x65, 0x61, 0x6c, 0x6c, 0x6f, 0x63, 0x47, 0x72,
-  0x6f, 0x77, 0x22, 0x20, 0x3a, 0x20, 0x66, 0x61, 0x6c, 0x73, 0x65, 0x0a,
-  0x7d, 0x0a
+  0x6f, 0x77, 0x22, 0x20, 0x3a, 0x20, 0x66, 0x61, 0x6c, 0x73, 0x65, 0x2c,
+  0x0a, 0x09, 0x22, 0x70, 0x72, 0x65, 0x61, 0x6c, 0x6c, 0x6f, 0x63, 0x43,
+  0x68, 0x61, 0x69, 0x6e, 0x22, 0x20, 0x3a, 0x20, 0x74, 0x72, 0x75, 0x65,
+  0x2c, 0x0a, 0x09, 0x22, 0x73, 0x79, 0x6e, 0x63, 0x49, 0x6e, 0x74, 0x65,
+  0x72, 0x76, 0x61, 0x6c, 0x22, 0x20, 0x3a, 0x20, 0x31, 0x30, 0x30, 0x30,
+  0x2c, 0x0a, 0x09, 0x22, 0x73, 0x74, 0x61, 0x67, 0x65, 0x54, 0x61, 0x69,
+  0x6c, 0x22, 0x20, 0x3a, 0x20, 0x74, 0x72, 0x75, 0x65, 0x2c, 0x0a, 0x09,
+  0x22, 0x6c, 0x6f, 0x67, 0x73, 0x50, 0x65, 0x72, 0x44, 0x69, 0x72, 0x22,
+  0x20, 0x3a, 0x20, 0x31, 0x30, 0x30, 0x0a, 0x7d, 0x0a
 };
-unsigned int lager_cfg_len = 122;
+unsigned int lager_cfg_len = 213;
@@ -0,0 +1,76 @@
+// Streaming checker for the LCG test pattern
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _LCGCHECK_H
+#define _LCGCHECK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The test pattern is the output of a 32 bit LCG started from state 0,
+// each word sent little-endian.  Each word is the generator state, so a
+// checker that loses its place can pick it up again from any 8 bytes of
+// good data.
+//
+// This is shared with the host tool in misc/, so keep it to code that
+// also builds as C++.
+
+static inline uint32_t lcg_next(uint32_t s)
+{
+	// Constants for mixed congruential generator from Numerical Recipes.
+	return s * 1664525 + 1013904223;
+}
+
+struct lcg_check {
+	uint32_t cur;		// Word being matched
+	unsigned int byte_idx;	// Next byte of it expected
+	bool synced;
+
+	uint64_t received;	// Bytes fed in
+	uint64_t ideal;		// Position in the pattern of the next byte
+	uint64_t good;		// Bytes that matched
+
+	uint64_t first_err;	// Offset in received data of first mismatch
+	uint32_t errors;	// Mismatches (each followed by a resync)
+	uint64_t dropped;	// Pattern bytes that never arrived
+	uint64_t duplicated;	// Bytes that arrived more than once
+
+	// While resyncing
+	uint8_t win[8];
+	unsigned int win_len;
+	uint64_t err_ideal;	// Where in the pattern it went wrong
+	uint64_t since_err;	// Bytes received since then
+
+	uint32_t first_ms, last_ms;
+};
+
+#define LCG_CHECK_NO_ERR UINT64_MAX
+
+void lcg_check_init(struct lcg_check *chk);
+void lcg_check_feed(struct lcg_check *chk, const uint8_t *data,
+		unsigned int len, uint32_t now_ms);
+uint32_t lcg_check_rate(const struct lcg_check *chk);
+
+#endif // _LCGCHECK_H
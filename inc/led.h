@@ -33,8 +33,12 @@
 void led_init_pin(GPIO_TypeDef *GPIOx, uint16_t GPIO_pin, bool sense);
 void led_set_morse_speed(int time_per_dot);
 void led_send_morse(char *string);
+void led_queue_morse(char *string);
+bool led_busy(void);
 void led_panic(char *string);
 void led_set(bool light);
+void led_show_fill(unsigned int fill, unsigned int max);
 void led_toggle();
+void led_tick(void);
 
 #endif
@@ -0,0 +1,85 @@
+// Framed log container format
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _LOGFRAME_H
+#define _LOGFRAME_H
+
+#include <stdint.h>
+
+// When "framed" is set in the config, the log is a sequence of 512 byte
+// frames, one per card sector, instead of a raw byte dump.  Each frame
+// carries up to LOGFRAME_PAYLOAD bytes of received data, so a reader can
+// tell exactly which data is missing or damaged after a card glitch.
+//
+// The CRC is computed by the STM32 CRC unit over the first 127 words of
+// the frame (everything but the CRC itself): polynomial 0x04C11DB7,
+// initial value 0xFFFFFFFF, fed a little-endian word at a time, MSB first,
+// with no reflection and no final XOR.
+//
+// This header is shared with the host decoder in misc/, so keep it
+// plain C.
+
+#define LOGFRAME_MAGIC 0x52464c4f	/* "OLFR" */
+
+#define LOGFRAME_SIZE 512
+#define LOGFRAME_HDR 16
+#define LOGFRAME_PAYLOAD (LOGFRAME_SIZE - LOGFRAME_HDR - 4)
+
+// First frame written since the logger started.
+#define LOGFRAME_FLAG_START	0x0001
+// The receive buffer overflowed while this frame was being filled, so
+// some data was dropped; it is somewhere after this frame's payload and
+// no more than a receive buffer's worth further on.
+#define LOGFRAME_FLAG_OVERFLOW	0x0002
+// The payload is a struct loggap instead of received data.
+#define LOGFRAME_FLAG_GAP	0x0004
+
+struct logframe {
+	uint32_t magic;
+	uint32_t seq;		// Counts up from 0 at each start
+	uint32_t time_ms;	// Time since boot when the frame was sealed
+	uint16_t len;		// Valid bytes of payload; rest is zero
+	uint16_t flags;
+	uint8_t payload[LOGFRAME_PAYLOAD];
+	uint32_t crc;
+};
+
+// Wherever received data was dropped because the receive buffer was full,
+// this marker is put into the log in its place-- as the payload of a
+// LOGFRAME_FLAG_GAP frame when framed, or inline in the raw byte stream
+// otherwise.  In a raw log, check guards against the magic turning up in
+// ordinary data, and the marker is followed by zeros up to the next 512
+// byte boundary in the file, so the data after it stays sector aligned.
+// (Not in compressed logs, whose blocks are packed anyway.)
+#define LOGGAP_MAGIC 0x5041474f		/* "OGAP" */
+
+struct loggap {
+	uint32_t magic;
+	uint32_t time_ms;	// Time since boot of the first dropped byte
+	uint32_t bytes;		// How many were dropped
+	uint32_t check;		// ~(magic ^ time_ms ^ bytes)
+};
+
+#endif // _LOGFRAME_H
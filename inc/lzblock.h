@@ -0,0 +1,65 @@
+// LZ block compression for the log stream
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _LZBLOCK_H
+#define _LZBLOCK_H
+
+#include <stdint.h>
+
+// When "compress" is set in the config, received data is stored as a
+// series of independently decodable blocks, each a struct lzblock header
+// followed by its data.  Compressed data is in the LZ4 block format
+// (sequences of token, literals, 16 bit offset, match length), and never
+// refers back outside its own block.  Gap markers (struct loggap) can
+// appear between blocks.  Blocks carry no checksum; combine with framed
+// mode to catch damaged data.
+//
+// This header is shared with the host decompressor in misc/, so keep it
+// plain C.
+
+#define LZBLOCK_MAGIC 0x345a4c4f	/* "OLZ4" */
+
+// Largest raw size of one block
+#define LZBLOCK_MAX_RAW 4096
+
+// Worst case compressed size for n bytes of input
+#define LZBLOCK_BOUND(n) ((n) + (n) / 255 + 16)
+
+// In stored_len: the data is stored as is, not compressed.
+#define LZBLOCK_STORED 0x8000
+
+struct lzblock {
+	uint32_t magic;
+	uint16_t raw_len;
+	uint16_t stored_len;	// Bytes of data following, plus flags
+};
+
+// The compressor's match finder: 2^LZ_HASH_BITS block offsets.
+#define LZ_HASH_BITS 10
+
+unsigned int lz_compress(const uint8_t *src, unsigned int len,
+		uint8_t *dst, uint16_t *table);
+
+#endif // _LZBLOCK_H
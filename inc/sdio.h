@@ -29,8 +29,22 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+// What sd_resume needs to take over a card sd_init has set up.
+struct sd_card_state {
+	uint32_t cid[4];
+	uint32_t sectors;
+	uint16_t rca;
+	uint8_t high_cap;
+	uint8_t four_bit;
+};
+
 int sd_init(bool fourbit);
+void sd_get_card_state(struct sd_card_state *state);
+int sd_resume(const struct sd_card_state *state);
 int sd_read(uint8_t *data, uint32_t sect_num);
+int sd_read_multi(uint8_t *data, uint32_t sect_num, uint16_t num_to_read);
 int sd_write(const uint8_t *data, uint32_t sect_num, uint16_t num_to_write);
+uint32_t sd_get_sectors(void);
+int sd_get_au_sectors(uint32_t *au_sectors);
 
 #endif
@@ -27,8 +27,10 @@
 #ifndef _SYSTICK_HANDLER_H
 #define _SYSTICK_HANDLER_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 extern volatile uint32_t systick_cnt;
+extern volatile bool systick_feed_watchdog;
 
 #endif // _SYSTICK_HANDLER_H
@@ -0,0 +1,72 @@
+// Microsecond timebase and cycle counter
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef _TIMEBASE_H
+#define _TIMEBASE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <stm32f4xx.h>
+
+// TIM5, a 32 bit timer, free-running at 1MHz: it wraps after ~71
+// minutes, so it's for timestamps and timeouts shorter than half that.
+// Anything longer stays on systick_cnt.  The DWT cycle counter is for
+// finer measurements still, and wraps much sooner (~44s at 96MHz).
+//
+// Timeouts are deadlines: take one with timebase_deadline, and poll
+// timebase_expired; that's right across the counter wrapping.  A host
+// build (misc/lagerreplay) has its own timebase.h with simulated time.
+
+extern uint32_t timebase_cycles_per_us;
+
+void timebase_init(uint32_t timer_hz, uint32_t cpu_hz);
+
+static inline uint32_t timebase_us(void)
+{
+	return TIM5->CNT;
+}
+
+static inline uint32_t timebase_cycles(void)
+{
+	return DWT->CYCCNT;
+}
+
+static inline uint32_t timebase_cycles_to_us(uint32_t cycles)
+{
+	return cycles / timebase_cycles_per_us;
+}
+
+static inline uint32_t timebase_deadline(uint32_t us)
+{
+	return timebase_us() + us;
+}
+
+static inline bool timebase_expired(uint32_t deadline)
+{
+	return (int32_t) (timebase_us() - deadline) >= 0;
+}
+
+#endif /* _TIMEBASE_H */
@@ -29,12 +29,32 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+// A run of received bytes dropped because the buffer was full.
+struct usart_gap {
+	uint32_t time;		// systick_cnt at the first dropped byte
+	unsigned int bytes;
+};
+
 void usart_init(uint32_t baud, void *rx_buf, unsigned int rx_buf_len);
-const char *usart_receive_chunk(unsigned int timeout,
+void usart_set_baud(uint32_t baud);
+uint16_t usart_brr(uint32_t pclk2_hz);
+void usart_load_brr(uint16_t brr);
+void usart_set_idle(void (*idle)(void));
+void usart_arm_wake(void (*wake)(void));
+void usart_grow_buffer(unsigned int new_len);
+void usart_stop(void);
+const char *usart_receive_chunk(uint32_t timeout_us,
 		unsigned int preferred_align,
 		unsigned int min_preferred_chunk,
 		unsigned int max_preferred_chunk,
+		bool hold_partial,
 		unsigned int *bytes_returned);
+const char *usart_peek_partial(unsigned int *bytes_returned);
+unsigned int usart_rx_spill_count(void);
+bool usart_take_gap(struct usart_gap *gap);
+unsigned int usart_rx_high_water_mark(void);
+unsigned int usart_rx_backlog(void);
+void usart_inject(const char *data, unsigned int len);
 
 void usart_int_handler() __attribute__((interrupt));
 
@@ -73,6 +73,9 @@ DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 #define ATA_GET_MODEL		21	/* Get model name */
 #define ATA_GET_SN			22	/* Get serial number */
 
+/* openlager specific ioctl command */
+#define GET_WRITE_RETRIES	64	/* Get count of retried write transactions */
+
 #ifdef __cplusplus
 }
 #endif
@@ -1040,6 +1040,98 @@ DWORD get_fat (	/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x7FFFFFFF:Cluste
 
 
 
+#if _FS_FREEIDX && !_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* Free extent index - Add an extent, keeping only the largest ones      */
+/*-----------------------------------------------------------------------*/
+
+static
+void fidx_add (
+	FATFS* fs,		/* File system object */
+	DWORD scl,		/* Start cluster of the free extent */
+	DWORD ncl		/* Number of clusters in the free extent */
+)
+{
+	DWORD i, min;
+
+
+	if (ncl == 0) return;
+	if (fs->fidx_n < _FS_FREEIDX) {		/* Room left in the table? */
+		i = fs->fidx_n++;
+	} else {							/* Replace the smallest one if this is larger */
+		for (min = 0, i = 1; i < _FS_FREEIDX; i++) {
+			if (fs->fidx[i][1] < fs->fidx[min][1]) min = i;
+		}
+		if (fs->fidx[min][1] >= ncl) return;
+		i = min;
+	}
+	fs->fidx[i][0] = scl;
+	fs->fidx[i][1] = ncl;
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Free extent index - Remove a cluster that is being allocated          */
+/*-----------------------------------------------------------------------*/
+
+static
+void fidx_take (
+	FATFS* fs,		/* File system object */
+	DWORD clst		/* Cluster being allocated */
+)
+{
+	DWORD i, scl, ncl;
+
+
+	for (i = 0; i < fs->fidx_n; i++) {
+		scl = fs->fidx[i][0]; ncl = fs->fidx[i][1];
+		if (clst - scl >= ncl) continue;	/* Not in this extent */
+		if (clst == scl) {					/* Trim the head */
+			fs->fidx[i][0]++; fs->fidx[i][1]--;
+		} else {							/* Trim the tail, or split it */
+			fs->fidx[i][1] = clst - scl;
+			fidx_add(fs, clst + 1, scl + ncl - clst - 1);
+		}
+		if (fs->fidx[i][1] == 0) {			/* Drop an emptied extent */
+			fs->fidx_n--;
+			fs->fidx[i][0] = fs->fidx[fs->fidx_n][0];
+			fs->fidx[i][1] = fs->fidx[fs->fidx_n][1];
+		}
+		break;
+	}
+}
+
+
+/*-----------------------------------------------------------------------*/
+/* Free extent index - Find a free extent                                */
+/*-----------------------------------------------------------------------*/
+
+static
+DWORD fidx_find (	/* 0:Nothing suitable in the index, >=2:Start cluster of the extent */
+	FATFS* fs,		/* File system object */
+	DWORD clst,		/* Prefer the nearest extent after this cluster */
+	DWORD ncl		/* Number of contiguous clusters needed */
+)
+{
+	DWORD i, scl, next = 0, wrap = 0;
+
+
+	for (i = 0; i < fs->fidx_n; i++) {
+		if (fs->fidx[i][1] < ncl) continue;
+		scl = fs->fidx[i][0];
+		if (scl > clst) {
+			if (!next || scl < next) next = scl;
+		} else {
+			if (!wrap || scl < wrap) wrap = scl;
+		}
+	}
+	return next ? next : wrap;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* FAT access - Change value of a FAT entry                              */
 /*-----------------------------------------------------------------------*/
@@ -1058,6 +1150,9 @@ FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 
 
 	if (clst >= 2 && clst < fs->n_fatent) {	/* Check if in valid range */
+#if _FS_FREEIDX
+		if (val != 0) fidx_take(fs, clst);	/* Allocated clusters leave the free extent index */
+#endif
 		switch (fs->fs_type) {
 		case FS_FAT12 :	/* Bitfield items */
 			bc = (UINT)clst; bc += bc / 2;
@@ -1332,17 +1427,23 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 	} else
 #endif
 	{	/* At the FAT12/16/32 */
-		ncl = scl;	/* Start cluster */
-		for (;;) {
-			ncl++;							/* Next cluster */
-			if (ncl >= fs->n_fatent) {		/* Check wrap-around */
-				ncl = 2;
-				if (ncl > scl) return 0;	/* No free cluster */
+		ncl = 0;
+#if _FS_FREEIDX
+		if (fs->fidx_n) ncl = fidx_find(fs, scl, 1);	/* Look up a free cluster in the index */
+#endif
+		if (!ncl) {
+			ncl = scl;	/* Start cluster */
+			for (;;) {
+				ncl++;							/* Next cluster */
+				if (ncl >= fs->n_fatent) {		/* Check wrap-around */
+					ncl = 2;
+					if (ncl > scl) return 0;	/* No free cluster */
+				}
+				cs = get_fat(obj, ncl);			/* Get the cluster status */
+				if (cs == 0) break;				/* Found a free cluster */
+				if (cs == 1 || cs == 0xFFFFFFFF) return cs;	/* An error occurred */
+				if (ncl == scl) return 0;		/* No free cluster */
 			}
-			cs = get_fat(obj, ncl);			/* Get the cluster status */
-			if (cs == 0) break;				/* Found a free cluster */
-			if (cs == 1 || cs == 0xFFFFFFFF) return cs;	/* An error occurred */
-			if (ncl == scl) return 0;		/* No free cluster */
 		}
 	}
 
@@ -3073,6 +3174,9 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 #if !_FS_READONLY
 		/* Initialize cluster allocation information */
 		fs->last_clst = fs->free_clst = 0xFFFFFFFF;
+#if _FS_FREEIDX
+		fs->fidx_n = 0;			/* Free extent index is built on request by f_buildidx() */
+#endif
 
 		/* Get FSINFO if available */
 		fs->fsi_flag = 0x80;
@@ -4347,6 +4451,76 @@ FRESULT f_getfree (
 
 
 
+#if _FS_FREEIDX
+/*-----------------------------------------------------------------------*/
+/* Build the Free Extent Index                                           */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_buildidx (
+	const TCHAR* path,	/* Path name of the logical drive number */
+	void* work,			/* Work area for multi-sector FAT reads (0:Use the sector window) */
+	UINT len			/* Size of the work area [bytes] */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD nfree, clst, sect, scl, ncl, val;
+	UINT i, n, nsect;
+	BYTE *buf, *p;
+
+
+	res = find_volume(&path, &fs, 0);
+	if (res != FR_OK) LEAVE_FF(fs, res);
+	fs->fidx_n = 0;
+	if (fs->fs_type != FS_FAT16 && fs->fs_type != FS_FAT32) LEAVE_FF(fs, FR_OK);	/* FAT16/32 only */
+
+	res = sync_window(fs);		/* The FAT on the disk must be up to date */
+	if (res != FR_OK) LEAVE_FF(fs, res);
+	buf = (BYTE*)work;
+	nsect = len / SS(fs);
+	if (!buf || !nsect) {		/* No work area, read through the window */
+		buf = fs->win; nsect = 1;
+	}
+	fs->winsect = 0xFFFFFFFF;	/* The window is going to be invalidated */
+
+	nfree = 0; scl = ncl = 0;
+	clst = 0; sect = 0;
+	while (clst < fs->n_fatent && sect < fs->fsize) {
+		n = (fs->fsize - sect < nsect) ? (UINT)(fs->fsize - sect) : nsect;
+		if (disk_read(fs->drv, buf, fs->fatbase + sect, n) != RES_OK) {
+			res = FR_DISK_ERR; break;
+		}
+		sect += n;
+		for (p = buf, i = n * SS(fs); i && clst < fs->n_fatent; clst++) {
+			if (fs->fs_type == FS_FAT16) {
+				val = ld_word(p); p += 2; i -= 2;
+			} else {
+				val = ld_dword(p) & 0x0FFFFFFF; p += 4; i -= 4;
+			}
+			if (clst < 2) continue;		/* Reserved entries */
+			if (val == 0) {				/* Free: extend the current extent */
+				if (ncl++ == 0) scl = clst;
+				nfree++;
+			} else {					/* In use: end the current extent */
+				fidx_add(fs, scl, ncl);
+				ncl = 0;
+			}
+		}
+	}
+	if (res == FR_OK) {
+		fidx_add(fs, scl, ncl);
+		fs->free_clst = nfree;	/* Now free_clst is valid */
+	} else {
+		fs->fidx_n = 0;
+	}
+
+	LEAVE_FF(fs, res);
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Truncate File                                                         */
 /*-----------------------------------------------------------------------*/
@@ -4364,9 +4538,9 @@ FRESULT f_truncate (
 	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);	/* Check validity */
 	if (!(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);	/* Check access mode */
 
-	if (fp->obj.objsize > fp->fptr) {
+	if (fp->obj.objsize >= fp->fptr) {	/* At the end too: f_expand mode 2 can leave clusters linked past it */
 		if (fp->fptr == 0) {	/* When set file size to zero, remove entire cluster chain */
-			res = remove_chain(&fp->obj, fp->obj.sclust, 0);
+			if (fp->obj.sclust) res = remove_chain(&fp->obj, fp->obj.sclust, 0);
 			fp->obj.sclust = 0;
 		} else {				/* When truncate a part of the file, remove remaining clusters */
 			ncl = get_fat(&fp->obj, fp->clust);
@@ -5005,7 +5179,7 @@ FRESULT f_setlabel (
 FRESULT f_expand (
 	FIL* fp,		/* Pointer to the file object */
 	FSIZE_t fsz,	/* File size to be expanded to */
-	BYTE opt		/* Operation mode 0:Find and prepare or 1:Find and allocate */
+	BYTE opt		/* Operation mode 0:Find and prepare, 1:Find and allocate or 2:Allocate, keep size */
 )
 {
 	FRESULT res;
@@ -5041,18 +5215,24 @@ FRESULT f_expand (
 	} else
 #endif
 	{
-		scl = clst = stcl; ncl = 0;
-		for (;;) {	/* Find a contiguous cluster block */
-			val = get_fat(&fp->obj, clst);
-			if (++clst >= fs->n_fatent) clst = 2;
-			if (val == 1) { res = FR_INT_ERR; break; }
-			if (val == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
-			if (val == 0) {	/* Is it a free cluster? */
-				if (++ncl == tcl) break;	/* Break if a contiguous cluster block was found */
-			} else {
-				scl = clst; ncl = 0;		/* Not a free cluster */
+		scl = 0;
+#if _FS_FREEIDX
+		if (fs->fidx_n) scl = fidx_find(fs, stcl - 1, tcl);	/* Look up a large enough extent in the index */
+#endif
+		if (!scl) {
+			scl = clst = stcl; ncl = 0;
+			for (;;) {	/* Find a contiguous cluster block */
+				val = get_fat(&fp->obj, clst);
+				if (++clst >= fs->n_fatent) clst = 2;
+				if (val == 1) { res = FR_INT_ERR; break; }
+				if (val == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+				if (val == 0) {	/* Is it a free cluster? */
+					if (++ncl == tcl) break;	/* Break if a contiguous cluster block was found */
+				} else {
+					scl = clst; ncl = 0;		/* Not a free cluster */
+				}
+				if (clst == stcl) { res = FR_DENIED; break; }	/* All cluster scanned? */
 			}
-			if (clst == stcl) { res = FR_DENIED; break; }	/* All cluster scanned? */
 		}
 		if (res == FR_OK) {
 			if (opt) {
@@ -5070,7 +5250,7 @@ FRESULT f_expand (
 
 	if (opt && res == FR_OK) {
 		fp->obj.sclust = scl;		/* Update allocation information */
-		fp->obj.objsize = fsz;
+		if (opt == 1) fp->obj.objsize = fsz;	/* Mode 2: size grows as data is written, FAT already linked */
 		if (_FS_EXFAT) fp->obj.stat = 2;
 		fp->flag |= _FA_MODIFIED;
 	}
@@ -5312,7 +5492,7 @@ FRESULT f_mkfs (
 	if (n_vol < 0x10000) {					/* Number of total sectors */
 		st_word(tbl + BPB_TotSec16, (WORD)n_vol);
 	} else {
-		st_dword(tbl + BPB_TotSec32, (WORD)n_vol);
+		st_dword(tbl + BPB_TotSec32, n_vol);
 	}
 	tbl[BPB_Media] = md;					/* Media descriptor */
 	st_word(tbl + BPB_SecPerTrk, 63);		/* Number of sectors per track */
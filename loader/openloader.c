@@ -26,23 +26,26 @@
 
 #include <stdbool.h>
 
+#include <stm32f4xx_crc.h>
 #include <stm32f4xx_flash.h>
+#include <stm32f4xx_iwdg.h>
 #include <stm32f4xx_rcc.h>
 
 #include <systick_handler.h>
+#include <timebase.h>
 
+#include <bootstate.h>
+#include <handoff.h>
+#include <imagehdr.h>
 #include <sdio.h>
 #include <ff.h>
 
 #include <led.h>
 
-extern uint32_t _efill;
-
 const void *_interrupt_vectors[FPU_IRQn] __attribute((section(".interrupt_vectors"))) = {
 };
 
-#define MAINPROGRAM_OFFSET 0x08010000 // from src/memory.ld
-void invoke_next_program()
+void invoke_next_program(uint32_t addr)
 {
 	// XXX should deinit interrupt-y things here... or at least mask
 	// interrupts.
@@ -51,7 +54,7 @@ void invoke_next_program()
 	RCC_APB2PeriphResetCmd(0xffffffff, DISABLE);
 	RCC_APB1PeriphResetCmd(0xffffffff, DISABLE);
 
-	void *memory = (void *) MAINPROGRAM_OFFSET;
+	void *memory = (void *) addr;
 
 	register uintptr_t stack_pointer asm ("r0") = *((const uintptr_t *)(memory));
 	register uintptr_t program_entry asm ("r1") = *((const uintptr_t *)(memory + sizeof(void *)));
@@ -76,6 +79,253 @@ void chk_flashop(FLASH_Status f)
 	}
 }
 
+// The program lives in one of two slots (see inc/bootstate.h).  A new
+// lager.bin is programmed into the one that isn't active, and booted on
+// trial: each trial boot is counted and runs under the watchdog, and if
+// the program hasn't confirmed it came up by the last, it's marked
+// failed and the active slot's run again.
+//
+// Each slot's record also holds a fingerprint of the lager.bin it came
+// from-- a CRC of the card's CID and the file's size and timestamp.
+// While it matches either slot, the card needn't be read at all;
+// otherwise the headers are read, and an image only if it's really
+// different.
+#define MAX_TRIAL_BOOTS 3
+
+// LSI is ~32KHz; /256 and 2500 counts is ~20s for a trial boot to
+// confirm in (or keep it from expiring).
+#define TRIAL_WDG_RELOAD 2500
+
+// Images are read and programmed this much at a time.
+#define BLOCK_WORDS 1024
+
+static const struct {
+	uint32_t addr;
+	uint16_t sector;
+} slot_sectors[NUM_SLOTS][2] = {
+	{
+		{ 0x08010000, FLASH_Sector_4 },		// 64K
+		{ 0x08020000, FLASH_Sector_5 },		// 128K
+	}, {
+		{ 0x08040000, FLASH_Sector_6 },		// 128K
+		{ 0x08060000, FLASH_Sector_7 },		// 128K, 64K used
+	},
+};
+
+static struct boot_state state;
+
+static uint32_t image_fingerprint(const struct sd_card_state *card,
+		const FILINFO *info)
+{
+	uint32_t words[6] = {
+		card->cid[0], card->cid[1], card->cid[2], card->cid[3],
+		info->fsize,
+		((uint32_t) info->fdate << 16) | info->ftime
+	};
+
+	CRC_ResetDR();
+
+	return CRC_CalcBlockCRC(words, 6);
+}
+
+// The HW CRC of what's programmed in a slot, at memory speed.
+static uint32_t flash_crc(uint8_t slot, uint32_t size)
+{
+	CRC_ResetDR();
+
+	return CRC_CalcBlockCRC((uint32_t *) SLOT_ADDR(slot),
+			size / sizeof(uint32_t));
+}
+
+// Whether what's in a slot is what was recorded there.  With no record
+// (what was put there by SWD) there's nothing to check.
+static bool slot_intact(uint8_t slot)
+{
+	const struct boot_slot *s = &state.slots[slot];
+
+	return !s->known || (flash_crc(slot, s->size) == s->crc);
+}
+
+// Reads the next block of the image; false on error or early end.
+static bool read_block(FIL *fil, uint32_t *buf, UINT words)
+{
+	UINT amount;
+
+	if (f_read(fil, buf, words * sizeof(*buf), &amount) != FR_OK) {
+		return false;
+	}
+
+	return amount == words * sizeof(*buf);
+}
+
+// Finds the image linked for addr in lager.bin, leaving the file at its
+// start.
+static bool find_image(FIL *fil, uint32_t addr, struct image_hdr *hdr)
+{
+	FSIZE_t pos = 0;
+	UINT amount;
+
+	while (pos < f_size(fil)) {
+		if ((f_lseek(fil, pos) != FR_OK) ||
+				(f_read(fil, hdr, sizeof(*hdr), &amount) != FR_OK)) {
+			// .. ---
+			led_send_morse("IO ");
+			return false;
+		}
+
+		if ((amount != sizeof(*hdr)) ||
+				(hdr->magic != IMAGE_HDR_MAGIC) ||
+				(hdr->check != ~(hdr->magic ^ hdr->addr ^
+						 hdr->size ^ hdr->crc))) {
+			// .... -.. .-.
+			led_send_morse("HDR ");
+			return false;
+		}
+
+		pos += sizeof(*hdr);
+
+		if ((hdr->size < 500) || (hdr->size % sizeof(uint32_t)) ||
+				(f_size(fil) - pos < hdr->size)) {
+			// Very short, not an integral number of words, or
+			// cut off.
+			led_send_morse("TRUNC ");
+			return false;
+		}
+
+		if (hdr->addr == addr) {
+			if (hdr->size > SLOT_BYTES) {
+				// -... .. --.
+				led_send_morse("BIG ");
+				return false;
+			}
+
+			return true;
+		}
+
+		pos += hdr->size;
+	}
+
+	// Built for some other layout of flash.
+	// ... .-.. --- -
+	led_send_morse("SLOT ");
+
+	return false;
+}
+
+// Erases the whole slot, so nothing of what was there before survives
+// past the image's end, then programs the image from the file a block at
+// a time, checking each word reads back as written, and checks the
+// result against the header's CRC.
+static void program_image(FIL *fil, uint8_t slot,
+		const struct image_hdr *hdr)
+{
+	uint32_t buf[BLOCK_WORDS];
+	uint32_t *prog_flash = (uint32_t *) SLOT_ADDR(slot);
+	UINT words = hdr->size / sizeof(*buf);
+
+	FLASH_Unlock();
+
+	for (int i = 0; i < 2; i++) {
+		// checks success, infloop blinking if not
+		chk_flashop(FLASH_EraseSector(slot_sectors[slot][i].sector,
+				VoltageRange_3));
+	}
+
+	led_send_morse("PRG ");
+
+	for (UINT i = 0; i < words; i += BLOCK_WORDS) {
+		UINT block = words - i;
+
+		if (block > BLOCK_WORDS) {
+			block = BLOCK_WORDS;
+		}
+
+		if (!read_block(fil, buf, block)) {
+			led_panic("FERR");
+		}
+
+		for (UINT j = 0; j < block; j++) {
+			chk_flashop(FLASH_ProgramWord(
+					(uint32_t) (prog_flash + i + j),
+					buf[j]));
+
+			if (prog_flash[i + j] != buf[j]) {
+				// ..-. . .-. .-.
+				led_panic("FERR");
+			}
+		}
+	}
+
+	FLASH_Lock();
+
+	if (flash_crc(slot, hdr->size) != hdr->crc) {
+		// ..-. . .-. .-.
+		led_panic("FERR");
+	}
+
+	led_send_morse(".. ");
+}
+
+static void record_image(uint8_t slot, uint32_t fingerprint,
+		const struct image_hdr *hdr)
+{
+	state.slots[slot].fingerprint = fingerprint;
+	state.slots[slot].size = hdr->size;
+	state.slots[slot].crc = hdr->crc;
+
+	bootstate_append(&state, BOOTREC_IMAGE, slot);
+}
+
+// Brings flash up to date with lager.bin, whose fingerprint doesn't match
+// either slot.
+static void update_image(uint32_t fingerprint)
+{
+	uint8_t target = (state.active + 1) % NUM_SLOTS;
+	FIL fil;
+	struct image_hdr hdr;
+
+	if (f_open(&fil, "0:lager.bin", FA_READ) != FR_OK) {
+		// .. ---
+		led_send_morse("IO ");
+		return;
+	}
+
+	if (!find_image(&fil, SLOT_ADDR(state.active), &hdr)) {
+		return;
+	}
+
+	// Perhaps just the running program copied again, or a different
+	// card with it; if so it only needs recording, and any trial of
+	// something else is off.
+	if (flash_crc(state.active, hdr.size) == hdr.crc) {
+		record_image(state.active, fingerprint, &hdr);
+
+		if (state.trial != NO_SLOT) {
+			bootstate_append(&state, BOOTREC_CONFIRM,
+					state.active);
+		}
+
+		return;
+	}
+
+	if (!find_image(&fil, SLOT_ADDR(target), &hdr)) {
+		return;
+	}
+
+	const struct boot_slot *s = &state.slots[target];
+
+	if (!s->known || (s->size != hdr.size) || (s->crc != hdr.crc) ||
+			(flash_crc(target, hdr.size) != hdr.crc)) {
+		// ..- .--.   ..- .--.
+		led_send_morse("UP UP ");
+
+		program_image(&fil, target, &hdr);
+	}
+
+	record_image(target, fingerprint, &hdr);
+	bootstate_append(&state, BOOTREC_TRIAL, target);
+}
+
 /* If anything goes wrong here, we'll still go to the main program.
  * But it's doubtful, because things going wrong here are likely to
  * affect the main program too.  So we are willing to pay the penalty
@@ -95,6 +345,11 @@ void try_loader_stuff()
 		return;
 	}
 
+	// The card stays set up from here on; tell the program how to
+	// pick it up.
+	sd_get_card_state(&boot_handoff.card);
+	boot_handoff.flags |= HANDOFF_CARD;
+
 	FATFS fatfs;
 
 	if (f_mount(&fatfs, "0:", 1) != FR_OK) {
@@ -103,70 +358,84 @@ void try_loader_stuff()
 		return;
 	}
 
-	FIL fil;
+	FILINFO info;
 
-	if (f_open(&fil, "0:lager.bin", FA_READ) != FR_OK) {
+	if (f_stat("0:lager.bin", &info) != FR_OK) {
 		// Missing image is not an error -> we don't blink
 		return;
 	}
 
-	uint32_t *prog_flash = &_efill;
-	UINT amount;
+	uint32_t fingerprint = image_fingerprint(&boot_handoff.card, &info);
 
-	bool diff = false;
+	for (int i = 0; i < NUM_SLOTS; i++) {
+		if (state.slots[i].known &&
+				(state.slots[i].fingerprint == fingerprint)) {
+			return;
+		}
+	}
 
-	// XXX elim magic number.
-	uint32_t buf[16384];    // Nice to have a lot of ram;
-	                        // can safely use 64k on this stack
-	                        // frame on the loader.
+	update_image(fingerprint);
+}
 
-	/* XXX Ideally we would set up to flash larger than 64k
-	 * programs, since there's 192k of flash... */
-	if (FR_OK != f_read(&fil, buf, sizeof(buf), &amount)) {
-		// .. ---
-		led_send_morse("IO ");
-		return;
-	}
+// Starts the watchdog; the program has to confirm before it runs out.
+static void start_trial_watchdog(void)
+{
+	IWDG_WriteAccessCmd(IWDG_WriteAccess_Enable);
+	IWDG_SetPrescaler(IWDG_Prescaler_256);
+	IWDG_SetReload(TRIAL_WDG_RELOAD);
+	IWDG_ReloadCounter();
+	IWDG_Enable();
+}
 
-	if ((amount < 500) || (amount % sizeof(*buf))) {
-		// Very short or not an integral number of words.
-		led_send_morse("TRUNC ");
-		return;
-	}
+// Picks the slot to run: the one on trial, if it's still got boots
+// left and is intact, otherwise the active one, checked against its
+// record first-- or failing that the other, if it's good.
+static uint8_t choose_slot(void)
+{
+	if (state.trial != NO_SLOT) {
+		uint8_t trial = state.trial;
+
+		if (state.attempts >= MAX_TRIAL_BOOTS) {
+			// Never came up; go back.
+			bootstate_append(&state, BOOTREC_REVERT, trial);
+
+			// -... .- -.-. -.-
+			led_send_morse("BACK ");
+		} else if (!slot_intact(trial)) {
+			bootstate_append(&state, BOOTREC_REVERT, trial);
 
-	amount /= sizeof(*buf);         // convert into word count
+			// -.-. .-. -.-.
+			led_send_morse("CRC ");
+		} else {
+			bootstate_append(&state, BOOTREC_ATTEMPT, trial);
 
-	for (int i = 0; i < amount; i++) {
-		if (buf[i] != prog_flash[i]) {
-			diff = true;
+			// Room for the program's confirm, so it never has
+			// to compact (and stall flash) while it's capturing.
+			bootstate_reserve(&state, 1);
 
-			// ..- .--.   ..- .--.
-			led_send_morse("UP UP ");
+			boot_handoff.flags |= HANDOFF_TRIAL;
+			start_trial_watchdog();
 
-			break;
+			return trial;
 		}
 	}
 
-	if (!diff) {
-		// no update necessary.. go to main firmware.
-		return;
+	if (slot_intact(state.active)) {
+		return state.active;
 	}
 
-	FLASH_Unlock();
-
-	// checks success, infloop blinking if not
-	chk_flashop(FLASH_EraseSector(FLASH_Sector_4, VoltageRange_3));
+	// -.-. .-. -.-.
+	led_send_morse("CRC ");
 
-	led_send_morse("PRG ");
+	uint8_t other = (state.active + 1) % NUM_SLOTS;
 
-	for (int i = 0; i < amount; i++) {
-		chk_flashop(FLASH_ProgramWord((uint32_t) (prog_flash + i),
-				buf[i]));
+	if (state.slots[other].known && !state.slots[other].failed &&
+			slot_intact(other)) {
+		return other;
 	}
 
-	led_send_morse(".. ");
-
-	FLASH_Lock();
+	// Nothing better to run.
+	return state.active;
 }
 
 int main()
@@ -210,7 +479,8 @@ int main()
 			RCC_AHB1Periph_GPIOB |
 			RCC_AHB1Periph_GPIOC |
 			RCC_AHB1Periph_GPIOD |
-			RCC_AHB1Periph_GPIOE,
+			RCC_AHB1Periph_GPIOE |
+			RCC_AHB1Periph_CRC,
 			ENABLE);
 
 	RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM2 |
@@ -239,9 +509,21 @@ int main()
 
 	SysTick_Config(16000000/250);   /* 250Hz systick */
 
+	timebase_init(16000000, 16000000);	/* For the card's timeouts */
+
+	boot_handoff.magic = 0;
+	boot_handoff.flags = 0;
+
+	bootstate_load(&state);
+
 	try_loader_stuff();
 
-	invoke_next_program();
+	uint8_t slot = choose_slot();
+
+	boot_handoff.slot = slot;
+	handoff_seal(&boot_handoff);
+
+	invoke_next_program(SLOT_ADDR(slot));
 
 	return 0;
 }
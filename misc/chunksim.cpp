@@ -0,0 +1,232 @@
+// Off-target simulation of receive chunk tuning
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Runs the chunk tuning controller (src/chunktune.c) against synthetic
+// card latency profiles, and compares it with the fixed parameters.  The
+// receive side follows usart_receive_chunk's rules: wait for min_chunk
+// or the timeout, stop at the end of the buffer, trim to 512 byte
+// alignment, and release a chunk only on the next call.
+//
+// BUF_KB defaults to the whole 114K rx_area, as plain logging gets once
+// it grows the buffer past the 74K used for early capture.  Framed,
+// compressed and disk trace modes take up to 40K of that for working
+// space, so 74 is the smallest buffer the firmware logs with.
+//
+// Build: g++ -O2 -std=c++11 -Iinc -o chunksim misc/chunksim.cpp src/chunktune.c
+// Usage: chunksim [RATE_BYTES_PER_SEC [BUF_KB [SECONDS]]]
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+#include <chunktune.h>
+
+namespace {
+
+// Write time for a write of size bytes starting at t (us)
+struct Profile {
+	const char *name;
+	double overhead_us;
+	double bytes_per_us;
+	double stall_every_us;		// Periodic stalls
+	double stall_us;
+	double random_stall_chance;	// Per write, 50-400ms
+};
+
+static const Profile profiles[] = {
+	{ "fast",     500,  20, 0,       0,      0 },
+	{ "slow",     5000, 4,  0,       0,      0 },
+	{ "periodic", 1500, 10, 2000000, 250000, 0 },
+	{ "random",   1500, 10, 0,       0,      0.02 },
+};
+
+struct Result {
+	uint64_t dropped = 0;
+	unsigned int high_water = 0;
+	uint64_t writes = 0;
+	uint64_t written = 0;
+	double fill_time = 0;		// Integral of fill over time
+};
+
+class Sim {
+public:
+	Sim(const Profile &p, uint32_t rate, unsigned int buf_len, bool tuned) :
+		prof(p), rate(rate), buf_len(buf_len), tuned(tuned),
+		rng(1234) { }
+
+	Result run(double seconds);
+
+private:
+	void advance(double to);
+	double write_time(unsigned int bytes);
+
+	const Profile &prof;
+	uint32_t rate;
+	unsigned int buf_len;
+	bool tuned;
+	std::mt19937 rng;
+
+	double t = 0;
+	uint64_t arrived = 0;	// Bytes the sender has sent
+	uint64_t consumed = 0;	// Bytes released by the receive side
+	unsigned int fill = 0;	// Bytes in the buffer
+	Result res;
+};
+
+// Input arrives continuously; anything that doesn't fit is dropped, as
+// usart_rxint does (the buffer holds at most buf_len - 1).
+void Sim::advance(double to) {
+	uint64_t total = (uint64_t) (to * rate / 1e6);
+	uint64_t n = total - arrived;
+	unsigned int room = buf_len - 1 - fill;
+	unsigned int take = n < room ? n : room;
+
+	res.fill_time += (fill + take / 2.0) * (to - t);
+	res.dropped += n - take;
+	fill += take;
+	arrived = total;
+	t = to;
+
+	if (fill > res.high_water) {
+		res.high_water = fill;
+	}
+}
+
+double Sim::write_time(unsigned int bytes) {
+	double us = prof.overhead_us + bytes / prof.bytes_per_us;
+
+	if (prof.stall_every_us &&
+			(uint64_t) ((t + us) / prof.stall_every_us) !=
+			(uint64_t) (t / prof.stall_every_us)) {
+		us += prof.stall_us;
+	}
+
+	if (prof.random_stall_chance &&
+			std::uniform_real_distribution<>(0, 1)(rng) <
+			prof.random_stall_chance) {
+		us += std::uniform_real_distribution<>(50000, 400000)(rng);
+	}
+
+	return us;
+}
+
+Result Sim::run(double seconds) {
+	struct chunk_tune tune;
+	unsigned int held = 0;		// Chunk returned, not yet released
+
+	chunk_tune_init(&tune, buf_len);
+
+	while (t < seconds * 1e6) {
+		double pass_start = t;
+
+		// Release the previous chunk
+		consumed += held;
+		fill -= held;
+		held = 0;
+
+		unsigned int rpos = consumed % buf_len;
+		unsigned int unalign = rpos % 512;
+		double deadline = t + tune.timeout_us;
+		unsigned int bytes;
+
+		// Busywait for a completion condition
+		while (true) {
+			unsigned int wpos = (consumed + fill) % buf_len;
+
+			if (wpos < rpos) {
+				bytes = buf_len - rpos;
+				break;
+			}
+
+			bytes = wpos - rpos;
+
+			if (bytes >= tune.min_chunk || t >= deadline) {
+				break;
+			}
+
+			advance(t + 100);
+		}
+
+		if (bytes > tune.max_chunk) {
+			bytes = tune.max_chunk;
+		}
+
+		if (bytes + unalign >= 512) {
+			bytes = (bytes + unalign) / 512 * 512 - unalign;
+		}
+
+		held = bytes;
+
+		double write_start = t;
+
+		if (bytes) {
+			advance(t + write_time(bytes));
+			res.writes++;
+			res.written += bytes;
+		}
+
+		if (tuned) {
+			chunk_tune_update(&tune, bytes, t - pass_start,
+					t - write_start, fill);
+		}
+	}
+
+	return res;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+	uint32_t rate = argc > 1 ? strtoul(argv[1], NULL, 0) : 200000;
+	unsigned int buf_len = (argc > 2 ? strtoul(argv[2], NULL, 0) : 114) *
+		1024;
+	double seconds = argc > 3 ? strtod(argv[3], NULL) : 60;
+
+	printf("%u bytes/s, %u byte buffer, %.0f s\n\n", rate, buf_len,
+			seconds);
+	printf("%-9s %-6s %10s %10s %9s %10s %10s\n", "profile", "mode",
+			"dropped", "highWater", "writes", "avgWrite",
+			"avgAgeMs");
+
+	for (const Profile &p : profiles) {
+		for (int tuned = 0; tuned < 2; tuned++) {
+			Sim sim(p, rate, buf_len, tuned);
+			Result r = sim.run(seconds);
+
+			printf("%-9s %-6s %10llu %10u %9llu %10.0f %10.1f\n",
+					p.name, tuned ? "tuned" : "fixed",
+					(unsigned long long) r.dropped,
+					r.high_water,
+					(unsigned long long) r.writes,
+					r.writes ? (double) r.written /
+						r.writes : 0.0,
+					r.fill_time / (seconds * 1e6) /
+						rate * 1000);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,425 @@
+// Host decoder for openlager framed logs
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Checks a log written with "framed" set (see inc/logframe.h), reports
+// sequence gaps, bad CRCs, unframed sectors, overflow flags and receive
+// gap markers on stderr, and optionally writes the recovered payload out.
+// Raw (unframed) logs are scanned for gap markers, which are stripped from
+// the output.  Also understands ring.bin, which it reads starting from the
+// oldest data.
+//
+// Build: g++ -O2 -std=c++11 -Iinc -o lagerframe misc/lagerframe.cpp
+// Usage: lagerframe [-q] [-o payload.bin] log000.txt
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <logframe.h>
+
+static_assert(sizeof(struct logframe) == LOGFRAME_SIZE, "frame layout");
+
+// Matches RING_MAGIC and the ring header in src/openlager.c
+static const uint32_t ring_magic = 0x474e524f;
+static const size_t ring_hdr_size = 512;
+
+namespace {
+
+class Crc32 {
+public:
+	Crc32() {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i << 24;
+
+			for (int j = 0; j < 8; j++) {
+				c = (c & 0x80000000) ? (c << 1) ^ 0x04C11DB7 : c << 1;
+			}
+
+			table[i] = c;
+		}
+	}
+
+	// Same as the STM32 CRC unit fed with CRC_CalcBlockCRC.
+	uint32_t block(const uint8_t *p, size_t words) const {
+		uint32_t crc = 0xFFFFFFFF;
+
+		for (size_t i = 0; i < words; i++, p += 4) {
+			for (int b = 3; b >= 0; b--) {
+				crc = (crc << 8) ^ table[(crc >> 24) ^ p[b]];
+			}
+		}
+
+		return crc;
+	}
+
+private:
+	uint32_t table[256];
+};
+
+static inline uint32_t get32(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint16_t get16(const uint8_t *p) {
+	return p[0] | (p[1] << 8);
+}
+
+class Decoder {
+public:
+	Decoder(FILE *out, bool quiet, bool framed) :
+		out(out), quiet(quiet), framed(framed) { }
+
+	// Decode len bytes of log; offsets reported are base + position.
+	void run(const uint8_t *data, size_t len, uint64_t base) {
+		if (framed) {
+			run_frames(data, len, base);
+		} else {
+			run_raw(data, len, base);
+		}
+	}
+
+	int summary() const;
+
+private:
+	void note(uint64_t off, const char *fmt, ...)
+		__attribute__((format(printf, 3, 4)));
+	void end_junk();
+	void emit(const uint8_t *data, size_t len);
+	bool is_gap(const uint8_t *p, uint64_t off);
+	void run_frames(const uint8_t *data, size_t len, uint64_t base);
+	void run_raw(const uint8_t *data, size_t len, uint64_t base);
+
+	Crc32 crc;
+	FILE *out;
+	bool quiet;
+	bool framed;
+
+	bool have_seq = false;
+	uint32_t next_seq = 0;
+
+	uint64_t junk_start = 0, junk_len = 0;
+
+	uint64_t frames = 0, payload = 0, starts = 0;
+	uint64_t bad_crc = 0, unframed = 0, gaps = 0, lost_frames = 0;
+	uint64_t overflows = 0;
+	uint64_t rx_gaps = 0, rx_dropped = 0;
+};
+
+void Decoder::note(uint64_t off, const char *fmt, ...) {
+	if (quiet) {
+		return;
+	}
+
+	va_list ap;
+
+	fprintf(stderr, "%12llu: ", (unsigned long long) off);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+void Decoder::end_junk() {
+	if (junk_len) {
+		note(junk_start, "%llu bytes without frames",
+				(unsigned long long) junk_len);
+		junk_len = 0;
+	}
+}
+
+void Decoder::emit(const uint8_t *data, size_t len) {
+	payload += len;
+
+	if (out && fwrite(data, 1, len, out) != len) {
+		perror("write");
+		exit(1);
+	}
+}
+
+// Checks for a struct loggap at p, and reports it if so.
+bool Decoder::is_gap(const uint8_t *p, uint64_t off) {
+	uint32_t magic = get32(p);
+	uint32_t time_ms = get32(p + 4);
+	uint32_t bytes = get32(p + 8);
+
+	if (magic != LOGGAP_MAGIC ||
+			get32(p + 12) != ~(magic ^ time_ms ^ bytes)) {
+		return false;
+	}
+
+	note(off, "receive gap: %u bytes dropped at %u ms", bytes, time_ms);
+	rx_gaps++;
+	rx_dropped += bytes;
+
+	return true;
+}
+
+void Decoder::run_raw(const uint8_t *data, size_t len, uint64_t base) {
+	size_t done = 0, pos = 0;
+
+	while (pos + sizeof(struct loggap) <= len) {
+		const uint8_t *p = (const uint8_t *) memchr(data + pos,
+				LOGGAP_MAGIC & 0xff,
+				len + 1 - sizeof(struct loggap) - pos);
+
+		if (!p) {
+			break;
+		}
+
+		pos = p - data;
+
+		if (!is_gap(p, base + pos)) {
+			pos++;
+			continue;
+		}
+
+		emit(data + done, pos - done);
+		pos += sizeof(struct loggap);
+
+		// Then zero fill to the next sector boundary.
+		pos = std::min<size_t>(pos + (-(base + pos) & 511), len);
+		done = pos;
+	}
+
+	emit(data + done, len - done);
+}
+
+void Decoder::run_frames(const uint8_t *data, size_t len, uint64_t base) {
+	for (size_t pos = 0; pos + LOGFRAME_SIZE <= len;
+			pos += LOGFRAME_SIZE) {
+		const uint8_t *f = data + pos;
+		uint64_t off = base + pos;
+
+		if (get32(f) != LOGFRAME_MAGIC) {
+			if (!junk_len) {
+				junk_start = off;
+			}
+
+			junk_len += LOGFRAME_SIZE;
+			unframed++;
+			continue;
+		}
+
+		end_junk();
+
+		uint32_t seq = get32(f + 4);
+		uint32_t time_ms = get32(f + 8);
+		uint16_t flen = get16(f + 12);
+		uint16_t flags = get16(f + 14);
+
+		if (crc.block(f, (LOGFRAME_SIZE - 4) / 4) !=
+				get32(f + LOGFRAME_SIZE - 4) ||
+				flen > LOGFRAME_PAYLOAD) {
+			note(off, "bad CRC, seq %u?", seq);
+			bad_crc++;
+			// Don't trust its sequence number; the next good
+			// frame tells us whether we lost anything else.
+			if (have_seq) {
+				next_seq++;
+			}
+			continue;
+		}
+
+		if (flags & LOGFRAME_FLAG_START) {
+			note(off, "logger start at %u ms", time_ms);
+			starts++;
+		} else if (have_seq && seq != next_seq) {
+			note(off, "sequence gap: expected %u, got %u at %u ms",
+					next_seq, seq, time_ms);
+			gaps++;
+			lost_frames += (uint32_t) (seq - next_seq);
+		}
+
+		if (flags & LOGFRAME_FLAG_OVERFLOW) {
+			note(off, "receive overflow near %u ms, after seq %u",
+					time_ms, seq);
+			overflows++;
+		}
+
+		have_seq = true;
+		next_seq = seq + 1;
+
+		frames++;
+
+		if (flags & LOGFRAME_FLAG_GAP) {
+			if (flen != sizeof(struct loggap) ||
+					!is_gap(f + LOGFRAME_HDR, off)) {
+				note(off, "bad gap marker");
+			}
+		} else {
+			emit(f + LOGFRAME_HDR, flen);
+		}
+	}
+
+	end_junk();
+}
+
+int Decoder::summary() const {
+	if (framed) {
+		fprintf(stderr, "%llu frames, %llu payload bytes, %llu starts\n",
+				(unsigned long long) frames,
+				(unsigned long long) payload,
+				(unsigned long long) starts);
+		fprintf(stderr, "%llu bad CRC, %llu unframed sectors, "
+				"%llu gaps (%llu frames), %llu overflows\n",
+				(unsigned long long) bad_crc,
+				(unsigned long long) unframed,
+				(unsigned long long) gaps,
+				(unsigned long long) lost_frames,
+				(unsigned long long) overflows);
+	} else {
+		fprintf(stderr, "raw log, %llu payload bytes\n",
+				(unsigned long long) payload);
+	}
+
+	fprintf(stderr, "%llu receive gaps, %llu bytes dropped\n",
+			(unsigned long long) rx_gaps,
+			(unsigned long long) rx_dropped);
+
+	return (bad_crc || gaps || overflows || rx_gaps) ? 2 : 0;
+}
+
+} // namespace
+
+static int finish(const Decoder &dec, FILE *out, const char *out_name) {
+	if (out && fclose(out)) {
+		perror(out_name);
+		return 1;
+	}
+
+	return dec.summary();
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr, "usage: %s [-q] [-o payload.bin] log\n", argv0);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	const char *out_name = NULL;
+	bool quiet = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "qo:")) != -1) {
+		switch (opt) {
+			case 'q':
+				quiet = true;
+				break;
+			case 'o':
+				out_name = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+	}
+
+	int fd = open(argv[optind], O_RDONLY);
+
+	if (fd < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	struct stat st;
+
+	if (fstat(fd, &st)) {
+		perror("stat");
+		return 1;
+	}
+
+	size_t len = st.st_size;
+
+	// Enough for a ring header's leading fields, or a gap marker
+	if (len < sizeof(struct loggap)) {
+		fprintf(stderr, "%s: too short\n", argv[optind]);
+		return 1;
+	}
+
+	const uint8_t *data = (const uint8_t *) mmap(NULL, len, PROT_READ,
+			MAP_PRIVATE, fd, 0);
+
+	if (data == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	madvise((void *) data, len, MADV_SEQUENTIAL);
+
+	FILE *out = NULL;
+
+	if (out_name) {
+		out = fopen(out_name, "wb");
+
+		if (!out) {
+			perror(out_name);
+			return 1;
+		}
+
+		setvbuf(out, NULL, _IOFBF, 1 << 20);
+	}
+
+	if (get32(data) == ring_magic) {
+		// Oldest data starts at head if the ring has wrapped.
+		uint32_t data_size = get32(data + 4);
+		uint32_t head = get32(data + 8);
+		uint32_t wraps = get32(data + 12);
+
+		if (len < ring_hdr_size + data_size || head >= data_size) {
+			fprintf(stderr, "bad ring header\n");
+			return 1;
+		}
+
+		const uint8_t *ring = data + ring_hdr_size;
+		const uint8_t *oldest = wraps ? ring + head : ring;
+		Decoder dec(out, quiet, get32(oldest) == LOGFRAME_MAGIC);
+
+		if (wraps) {
+			dec.run(ring + head, data_size - head,
+					ring_hdr_size + head);
+		}
+
+		dec.run(ring, head, ring_hdr_size);
+
+		return finish(dec, out, out_name);
+	}
+
+	Decoder dec(out, quiet, get32(data) == LOGFRAME_MAGIC);
+
+	dec.run(data, len, 0);
+
+	return finish(dec, out, out_name);
+}
@@ -0,0 +1,168 @@
+// Adds the loader's header to a program image
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Turns the linker's raw program images-- one per program slot-- into
+// lager.bin for the card: each has its trailing padding trimmed off (the
+// loader leaves it as erased flash), and an image_hdr from
+// inc/imagehdr.h, saying where it's linked, put in front.
+//
+// Build: g++ -O2 -std=c++11 -Iinc -o lagerimg misc/lagerimg.cpp
+// Usage: lagerimg lager.bin build/lager.bin@0x08010000 build/lager_b.bin@0x08040000
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <imagehdr.h>
+
+static_assert(sizeof(struct image_hdr) == 20, "header layout");
+
+namespace {
+
+class Crc32 {
+public:
+	Crc32() {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i << 24;
+
+			for (int j = 0; j < 8; j++) {
+				c = (c & 0x80000000) ? (c << 1) ^ 0x04C11DB7 : c << 1;
+			}
+
+			table[i] = c;
+		}
+	}
+
+	// Same as the STM32 CRC unit fed with CRC_CalcBlockCRC.
+	uint32_t block(const uint8_t *p, size_t words) const {
+		uint32_t crc = 0xFFFFFFFF;
+
+		for (size_t i = 0; i < words; i++, p += 4) {
+			for (int b = 3; b >= 0; b--) {
+				crc = (crc << 8) ^ table[(crc >> 24) ^ p[b]];
+			}
+		}
+
+		return crc;
+	}
+
+private:
+	uint32_t table[256];
+};
+
+}
+
+// Reads a raw image and writes it, trimmed, with its header.
+static bool add_image(FILE *out, const char *name, uint32_t addr,
+		const Crc32 &crc) {
+	FILE *in = fopen(name, "rb");
+
+	if (!in) {
+		perror(name);
+		return false;
+	}
+
+	std::vector<uint8_t> image;
+	uint8_t chunk[4096];
+	size_t got;
+
+	while ((got = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+		image.insert(image.end(), chunk, chunk + got);
+	}
+
+	fclose(in);
+
+	if (image.size() % 4) {
+		fprintf(stderr, "%s: not a whole number of words\n", name);
+		return false;
+	}
+
+	size_t size = image.size();
+
+	while ((size >= 4) && (image[size - 1] == 0xff) &&
+			(image[size - 2] == 0xff) && (image[size - 3] == 0xff) &&
+			(image[size - 4] == 0xff)) {
+		size -= 4;
+	}
+
+	struct image_hdr hdr;
+
+	hdr.magic = IMAGE_HDR_MAGIC;
+	hdr.addr = addr;
+	hdr.size = size;
+	hdr.crc = crc.block(image.data(), size / 4);
+	hdr.check = ~(hdr.magic ^ hdr.addr ^ hdr.size ^ hdr.crc);
+
+	if ((fwrite(&hdr, sizeof(hdr), 1, out) != 1) ||
+			(fwrite(image.data(), 1, size, out) != size)) {
+		perror("write");
+		return false;
+	}
+
+	printf("%s: %zu bytes at %08x, CRC %08x\n", name, size, addr, hdr.crc);
+
+	return true;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 3) {
+		fprintf(stderr, "Usage: lagerimg OUTPUT RAW_IMAGE@ADDR...\n");
+		return 1;
+	}
+
+	FILE *out = fopen(argv[1], "wb");
+
+	if (!out) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	Crc32 crc;
+
+	for (int i = 2; i < argc; i++) {
+		std::string arg(argv[i]);
+		size_t at = arg.rfind('@');
+
+		if (at == std::string::npos) {
+			fprintf(stderr, "%s: no load address\n", argv[i]);
+			return 1;
+		}
+
+		uint32_t addr = strtoul(arg.c_str() + at + 1, NULL, 0);
+
+		if (!add_image(out, arg.substr(0, at).c_str(), addr, crc)) {
+			return 1;
+		}
+	}
+
+	if (fclose(out)) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	return 0;
+}
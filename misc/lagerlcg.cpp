@@ -0,0 +1,315 @@
+// Host tool for end-to-end LCG pattern tests
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Sends the LCG test pattern (see inc/lcgcheck.h) to a logger running
+// with "verifyLcg" set, and checks the pattern wherever it ends up: from
+// a serial port or pty, or in a raw log copied off the card.  Checking
+// uses the same code as the logger.
+//
+// To try it without hardware, over a pty pair:
+//   socat pty,raw,echo=0,link=/tmp/lagerA pty,raw,echo=0,link=/tmp/lagerB &
+//   lagerlcg recv /tmp/lagerB & lagerlcg send /tmp/lagerA 2000000 10000000
+//
+// Build: g++ -O2 -std=c++11 -Iinc -o lagerlcg misc/lagerlcg.cpp src/lcgcheck.c
+// Usage: lagerlcg send DEV BAUD [BYTES]
+//        lagerlcg recv DEV [BAUD]
+//        lagerlcg check LOG
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <lcgcheck.h>
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int) {
+	stop = 1;
+}
+
+static uint32_t now_ms() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static speed_t baud_const(unsigned long baud) {
+	static const struct {
+		unsigned long baud;
+		speed_t speed;
+	} bauds[] = {
+		{ 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 },
+		{ 57600, B57600 }, { 115200, B115200 }, { 230400, B230400 },
+		{ 460800, B460800 }, { 500000, B500000 }, { 921600, B921600 },
+		{ 1000000, B1000000 }, { 1500000, B1500000 },
+		{ 2000000, B2000000 }, { 2500000, B2500000 },
+		{ 3000000, B3000000 }, { 4000000, B4000000 },
+	};
+
+	for (size_t i = 0; i < sizeof(bauds) / sizeof(*bauds); i++) {
+		if (bauds[i].baud == baud) {
+			return bauds[i].speed;
+		}
+	}
+
+	fprintf(stderr, "unsupported baud rate %lu\n", baud);
+	exit(1);
+}
+
+// Opens a serial port raw, 8N1, no flow control.  A pty takes the
+// settings and ignores the rate.
+static int open_port(const char *dev, unsigned long baud, int mode) {
+	int fd = open(dev, mode | O_NOCTTY);
+
+	if (fd < 0) {
+		perror(dev);
+		exit(1);
+	}
+
+	struct termios tio;
+
+	if (tcgetattr(fd, &tio)) {
+		perror(dev);
+		exit(1);
+	}
+
+	cfmakeraw(&tio);
+	tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 0;
+
+	if (baud) {
+		speed_t speed = baud_const(baud);
+
+		cfsetispeed(&tio, speed);
+		cfsetospeed(&tio, speed);
+	}
+
+	if (tcsetattr(fd, TCSANOW, &tio)) {
+		perror(dev);
+		exit(1);
+	}
+
+	return fd;
+}
+
+static void report(const struct lcg_check &chk, bool rate) {
+	fprintf(stderr, "received %llu good %llu errors %u dropped %llu "
+			"duplicated %llu",
+			(unsigned long long) chk.received,
+			(unsigned long long) chk.good, chk.errors,
+			(unsigned long long) chk.dropped,
+			(unsigned long long) chk.duplicated);
+
+	if (chk.first_err != LCG_CHECK_NO_ERR) {
+		fprintf(stderr, " first error at %llu",
+				(unsigned long long) chk.first_err);
+	}
+
+	if (rate) {
+		fprintf(stderr, " %u bytes/s", lcg_check_rate(&chk));
+	}
+
+	fputc('\n', stderr);
+}
+
+static int do_send(const char *dev, unsigned long baud, uint64_t total) {
+	int fd = open_port(dev, baud, O_WRONLY);
+	uint32_t buf[1024];
+	uint32_t s = 0;
+	uint64_t sent = 0;
+	uint32_t start = now_ms();
+
+	while (!stop && (!total || sent < total)) {
+		for (size_t i = 0; i < sizeof(buf) / sizeof(*buf); i++) {
+			s = lcg_next(s);
+			buf[i] = s;	// Little-endian host assumed
+		}
+
+		size_t len = sizeof(buf);
+
+		if (total && total - sent < len) {
+			len = total - sent;
+		}
+
+		const uint8_t *p = (const uint8_t *) buf;
+
+		while (len) {
+			ssize_t n = write(fd, p, len);
+
+			if (n < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+
+				perror("write");
+				return 1;
+			}
+
+			p += n;
+			len -= n;
+			sent += n;
+		}
+	}
+
+	tcdrain(fd);
+
+	uint32_t ms = now_ms() - start;
+
+	fprintf(stderr, "sent %llu bytes in %u ms (%llu bytes/s)\n",
+			(unsigned long long) sent, ms,
+			ms ? (unsigned long long) (sent * 1000 / ms) : 0ULL);
+
+	return 0;
+}
+
+static int do_recv(const char *dev, unsigned long baud) {
+	int fd = open_port(dev, baud, O_RDONLY);
+	struct lcg_check chk;
+	uint8_t buf[4096];
+	uint32_t last_report = now_ms();
+
+	lcg_check_init(&chk);
+
+	while (!stop) {
+		ssize_t n = read(fd, buf, sizeof(buf));
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			// A pty reports EIO once the other side closes.
+			if (errno != EIO) {
+				perror("read");
+			}
+
+			break;
+		}
+
+		if (!n) {
+			break;
+		}
+
+		lcg_check_feed(&chk, buf, n, now_ms());
+
+		if (now_ms() - last_report >= 1000) {
+			report(chk, true);
+			last_report = now_ms();
+		}
+	}
+
+	report(chk, true);
+
+	return (chk.errors || !chk.good) ? 2 : 0;
+}
+
+static int do_check(const char *name) {
+	int fd = open(name, O_RDONLY);
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(name);
+		return 1;
+	}
+
+	struct lcg_check chk;
+
+	lcg_check_init(&chk);
+
+	if (st.st_size) {
+		const uint8_t *data = (const uint8_t *) mmap(NULL,
+				st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (data == MAP_FAILED) {
+			perror("mmap");
+			return 1;
+		}
+
+		madvise((void *) data, st.st_size, MADV_SEQUENTIAL);
+
+		// Feed it in pieces, as lcg_check_feed takes an unsigned int.
+		for (off_t pos = 0; pos < st.st_size; pos += 1 << 30) {
+			off_t len = st.st_size - pos;
+
+			if (len > 1 << 30) {
+				len = 1 << 30;
+			}
+
+			lcg_check_feed(&chk, data + pos, len, 0);
+		}
+	}
+
+	report(chk, false);
+
+	return (chk.errors || !chk.good) ? 2 : 0;
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr, "usage: %s send DEV BAUD [BYTES]\n"
+			"       %s recv DEV [BAUD]\n"
+			"       %s check LOG\n", argv0, argv0, argv0);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	if (argc < 3) {
+		usage(argv[0]);
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	if (!strcmp(argv[1], "send") && (argc == 4 || argc == 5)) {
+		return do_send(argv[2], strtoul(argv[3], NULL, 0),
+				argc == 5 ? strtoull(argv[4], NULL, 0) : 0);
+	}
+
+	if (!strcmp(argv[1], "recv") && (argc == 3 || argc == 4)) {
+		return do_recv(argv[2],
+				argc == 4 ? strtoul(argv[3], NULL, 0) : 0);
+	}
+
+	if (!strcmp(argv[1], "check") && argc == 3) {
+		return do_check(argv[2]);
+	}
+
+	usage(argv[0]);
+
+	return 1;
+}
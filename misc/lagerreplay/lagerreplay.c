@@ -0,0 +1,539 @@
+// Card latency trace replay, for sizing the receive buffer
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Replays a card operation trace recorded with traceDisk (trace.bin) as
+// the latency of a simulated card, while data streams in at a steady
+// rate through the real receive and filesystem code: shared/usart.c,
+// src/chunktune.c and FatFs.  The logging loop follows do_usart_logging's
+// plain path: receive a chunk, f_write it, and sync when a pass finds
+// nothing new (or every syncInterval).  Each trial runs in a forked
+// child, so all start from fresh driver and filesystem state on the same
+// freshly formatted volume.
+//
+// A replayed operation takes its recorded time, less the card's best
+// per-sector time for the recorded size, plus that for the size actually
+// asked for.  So stalls carry over however our writes end up sized.
+// Writes step through the trace's writes and reads through its reads,
+// wrapping around.  Only time waiting on the card is modelled.
+//
+// Without -b, it searches for the smallest buffer (in 512 byte steps)
+// that loses nothing.
+//
+// Build: gcc -O2 -std=gnu99 -Imisc/lagerreplay -Iinc -Ilibs/fatfs -o lagerreplay misc/lagerreplay/lagerreplay.c shared/usart.c src/chunktune.c libs/fatfs/ff.c
+// Usage: lagerreplay [-b BUF_BYTES] [-s SECONDS] [-i SYNC_MS] [-p PREALLOC_BYTES] [-t] TRACE RATE_BYTES_PER_SEC
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <stm32f4xx.h>
+#include <systick_handler.h>
+
+#include <chunktune.h>
+#include <diskio.h>
+#include <disktrace.h>
+#include <ff.h>
+#include <usart.h>
+
+GPIO_TypeDef sim_gpioa, sim_gpiob;
+USART_TypeDef sim_usart1;
+
+// Simulated time per busy-wait pass, or tick count read
+#define POLL_NS 10000
+
+// Read time when the trace has no reads
+#define DEFAULT_READ_NS 300000
+
+#define MIN_BUF 4096
+#define MAX_BUF (16 * 1024 * 1024)
+
+struct replay_ops {
+	struct disk_trace_rec *recs;
+	size_t count;
+	size_t next;
+	double sector_ns;	// Best per-sector time seen
+};
+
+static struct replay_ops writes, reads;
+static unsigned int cycles_per_us;
+
+static uint8_t *image;
+static DWORD image_sectors;
+static bool replaying;
+
+static uint64_t now_ns;
+static uint64_t end_ns;
+static double rate;
+static uint64_t arrived;
+static bool advancing;
+
+struct trial {
+	unsigned int buf_len;
+	uint32_t seconds;
+	uint32_t sync_ms;
+	uint32_t prealloc;
+	bool auto_tune;
+};
+
+// Moves simulated time on, and delivers what would have arrived by then.
+static void sim_advance(uint64_t ns)
+{
+	static const char fill[256];
+
+	// usart_rx_store reads the tick count when it drops data.
+	advancing = true;
+
+	now_ns += ns;
+
+	uint64_t t = (now_ns < end_ns) ? now_ns : end_ns;
+	uint64_t due = t * rate / 1e9;
+
+	while (arrived < due) {
+		uint64_t n = due - arrived;
+
+		if (n > sizeof(fill)) {
+			n = sizeof(fill);
+		}
+
+		usart_inject(fill, n);
+		arrived += n;
+	}
+
+	advancing = false;
+}
+
+uint32_t sim_systick(void)
+{
+	if (!advancing) {
+		sim_advance(POLL_NS);
+	}
+
+	return now_ns / 4000000;
+}
+
+uint32_t timebase_cycles_per_us = 96;
+
+uint32_t sim_us(void)
+{
+	if (!advancing) {
+		sim_advance(POLL_NS);
+	}
+
+	return now_ns / 1000;
+}
+
+static double rec_ns(const struct disk_trace_rec *rec)
+{
+	return rec->cycles * 1000.0 / cycles_per_us;
+}
+
+static uint64_t replay_ns(struct replay_ops *ops, UINT count)
+{
+	if (!ops->count) {
+		return DEFAULT_READ_NS;
+	}
+
+	const struct disk_trace_rec *rec = &ops->recs[ops->next++ % ops->count];
+
+	double ns = rec_ns(rec) - ops->sector_ns * rec->sectors;
+
+	if (ns < 0) {
+		ns = 0;
+	}
+
+	return ns + ops->sector_ns * count;
+}
+
+DSTATUS disk_status(BYTE pdrv)
+{
+	return pdrv ? STA_NOINIT : 0;
+}
+
+DSTATUS disk_initialize(BYTE pdrv)
+{
+	return pdrv ? STA_NOINIT : 0;
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
+{
+	if (pdrv || (sector + count > image_sectors)) {
+		return RES_PARERR;
+	}
+
+	memcpy(buff, image + (size_t) sector * 512, (size_t) count * 512);
+
+	if (replaying) {
+		sim_advance(replay_ns(&reads, count));
+	}
+
+	return RES_OK;
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count)
+{
+	if (pdrv || (sector + count > image_sectors)) {
+		return RES_PARERR;
+	}
+
+	memcpy(image + (size_t) sector * 512, buff, (size_t) count * 512);
+
+	if (replaying) {
+		sim_advance(replay_ns(&writes, count));
+	}
+
+	return RES_OK;
+}
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
+{
+	if (pdrv) {
+		return RES_PARERR;
+	}
+
+	switch (cmd) {
+	case CTRL_SYNC:
+		return RES_OK;
+	case GET_SECTOR_COUNT:
+		*(DWORD *) buff = image_sectors;
+		return RES_OK;
+	case GET_BLOCK_SIZE:
+		*(DWORD *) buff = 8192;		// 4MB AU
+		return RES_OK;
+	case GET_WRITE_RETRIES:
+		*(DWORD *) buff = 0;
+		return RES_OK;
+	}
+
+	return RES_PARERR;
+}
+
+static void add_op(struct replay_ops *ops, const struct disk_trace_rec *rec)
+{
+	ops->recs = realloc(ops->recs, (ops->count + 1) * sizeof(*rec));
+
+	if (!ops->recs) {
+		perror("realloc");
+		exit(1);
+	}
+
+	ops->recs[ops->count++] = *rec;
+
+	double per_sector = rec_ns(rec) / rec->sectors;
+
+	if ((ops->count == 1) || (per_sector < ops->sector_ns)) {
+		ops->sector_ns = per_sector;
+	}
+}
+
+static void load_trace(const char *name)
+{
+	FILE *f = fopen(name, "rb");
+
+	if (!f) {
+		perror(name);
+		exit(1);
+	}
+
+	struct disk_trace_hdr hdr;
+
+	if ((fread(&hdr, sizeof(hdr), 1, f) != 1) ||
+			(hdr.magic != DISK_TRACE_MAGIC) ||
+			(hdr.rec_size != sizeof(struct disk_trace_rec)) ||
+			!hdr.cycles_per_us) {
+		fprintf(stderr, "%s: not a card trace\n", name);
+		exit(1);
+	}
+
+	cycles_per_us = hdr.cycles_per_us;
+
+	struct disk_trace_rec rec;
+	unsigned long lost = 0;
+	double max_ns = 0;
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		if (rec.flags & DISK_TRACE_LOST) {
+			lost += rec.lba;
+			continue;
+		}
+
+		if (!rec.sectors) {
+			continue;
+		}
+
+		if (rec.flags & DISK_TRACE_WRITE) {
+			add_op(&writes, &rec);
+
+			if (rec_ns(&rec) > max_ns) {
+				max_ns = rec_ns(&rec);
+			}
+		} else {
+			add_op(&reads, &rec);
+		}
+	}
+
+	fclose(f);
+
+	if (!writes.count) {
+		fprintf(stderr, "%s: no writes traced\n", name);
+		exit(1);
+	}
+
+	printf("trace: %zu writes, %zu reads, %lu not recorded\n",
+			writes.count, reads.count, lost);
+	printf("trace: best %.1f us/sector written, longest write %.1f ms\n",
+			writes.sector_ns / 1000, max_ns / 1e6);
+}
+
+// Formats the simulated card, untimed; trials start from copies of it.
+static void format_image(uint64_t bytes)
+{
+	static FATFS fs;
+
+	image_sectors = bytes / 512;
+	image = calloc(image_sectors, 512);
+
+	if (!image) {
+		perror("calloc");
+		exit(1);
+	}
+
+	// This FatFs formats with the registered volume's work area.
+	if ((f_mount(&fs, "0:", 0) != FR_OK) ||
+			(f_mkfs("0:", 0, 32768) != FR_OK)) {
+		fprintf(stderr, "f_mkfs failed\n");
+		exit(1);
+	}
+}
+
+static void trial_child(const struct trial *tr)
+{
+	static FATFS fs;
+	FIL fil;
+	UINT written;
+
+	char *rx_buf = malloc(tr->buf_len);
+
+	if (!rx_buf || (f_mount(&fs, "0:", 1) != FR_OK) ||
+			(f_open(&fil, "log.txt",
+				FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)) {
+		fprintf(stderr, "trial setup failed\n");
+		exit(2);
+	}
+
+	if (tr->prealloc) {
+		f_expand(&fil, tr->prealloc, 2);
+	}
+
+	replaying = true;
+	end_ns = now_ns + tr->seconds * 1000000000ULL;
+
+	usart_init(0, rx_buf, tr->buf_len);
+
+	struct chunk_tune tune;
+
+	chunk_tune_init(&tune, tr->buf_len);
+
+	uint32_t sync_ticks = tr->sync_ms / 4;
+	uint32_t last_sync = systick_cnt;
+	bool unsynced = false;
+	uint64_t pass_start = now_ns;
+
+	while (1) {
+		const char *pos;
+		unsigned int amt;
+
+		pos = usart_receive_chunk(tune.timeout_us, 512,
+				tune.min_chunk, tune.max_chunk, false, &amt);
+
+		uint64_t store_start = now_ns;
+
+		// Losses are counted by the driver; just move past them.
+		struct usart_gap gap;
+
+		while (usart_take_gap(&gap));
+
+		if (amt) {
+			if ((f_write(&fil, pos, amt, &written) != FR_OK) ||
+					(written != amt)) {
+				fprintf(stderr, "f_write failed; card full?\n");
+				exit(2);
+			}
+
+			unsynced = true;
+		}
+
+		uint32_t since_sync = systick_cnt - last_sync;
+
+		if (unsynced && (since_sync >= sync_ticks) &&
+				(!amt || sync_ticks)) {
+			if (f_sync(&fil) != FR_OK) {
+				fprintf(stderr, "f_sync failed\n");
+				exit(2);
+			}
+
+			last_sync = systick_cnt;
+			unsynced = false;
+		}
+
+		if (tr->auto_tune) {
+			chunk_tune_update(&tune, amt,
+					(now_ns - pass_start) / 1000,
+					(now_ns - store_start) / 1000,
+					usart_rx_backlog());
+		}
+
+		pass_start = now_ns;
+
+		if ((now_ns >= end_ns) && !amt && !unsynced) {
+			break;
+		}
+	}
+
+	unsigned int spilled = usart_rx_spill_count();
+
+	printf("%9u %10u %10u %12lu\n", tr->buf_len,
+			usart_rx_high_water_mark(), spilled,
+			(unsigned long) f_size(&fil));
+
+	exit(spilled ? 1 : 0);
+}
+
+// Returns whether the trial lost nothing.
+static bool run_trial(const struct trial *tr)
+{
+	fflush(stdout);
+
+	pid_t pid = fork();
+
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+
+	if (!pid) {
+		trial_child(tr);
+	}
+
+	int status;
+
+	if ((waitpid(pid, &status, 0) < 0) || !WIFEXITED(status) ||
+			(WEXITSTATUS(status) > 1)) {
+		fprintf(stderr, "trial failed\n");
+		exit(1);
+	}
+
+	return WEXITSTATUS(status) == 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: lagerreplay [-b BUF_BYTES] [-s SECONDS] "
+			"[-i SYNC_MS] [-p PREALLOC_BYTES] [-t] TRACE "
+			"RATE_BYTES_PER_SEC\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct trial tr = { .seconds = 60 };
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:s:i:p:t")) != -1) {
+		switch (opt) {
+		case 'b':
+			tr.buf_len = strtoul(optarg, NULL, 0) / 512 * 512;
+			break;
+		case 's':
+			tr.seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			tr.sync_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			tr.prealloc = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			tr.auto_tune = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((argc - optind != 2) || !tr.seconds) {
+		usage();
+	}
+
+	load_trace(argv[optind]);
+
+	rate = strtod(argv[optind + 1], NULL);
+
+	if (rate <= 0) {
+		usage();
+	}
+
+	// Room for the log, preallocation and the filesystem, with margin
+	uint64_t need = 2 * (rate * tr.seconds + tr.prealloc);
+
+	format_image((need > (256 << 20)) ? need : (256 << 20));
+
+	printf("%9s %10s %10s %12s\n", "buffer", "highWater", "dropped",
+			"logged");
+
+	if (tr.buf_len) {
+		return run_trial(&tr) ? 0 : 1;
+	}
+
+	tr.buf_len = MAX_BUF;
+
+	if (!run_trial(&tr)) {
+		printf("loses data even with a %u byte buffer\n", MAX_BUF);
+		return 1;
+	}
+
+	unsigned int lo = MIN_BUF / 512 - 1;	// Known to lose, or assumed
+	unsigned int hi = MAX_BUF / 512;	// Known not to
+
+	while (hi - lo > 1) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		tr.buf_len = mid * 512;
+
+		if (run_trial(&tr)) {
+			hi = mid;
+		} else {
+			lo = mid;
+		}
+	}
+
+	printf("minimum buffer for no loss at %.0f bytes/s: %u bytes\n",
+			rate, hi * 512);
+
+	return 0;
+}
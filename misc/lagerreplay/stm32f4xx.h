@@ -0,0 +1,133 @@
+// Host stand-in for the STM32F4xx device headers
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Just enough of the StdPeriph API for shared/usart.c to build on the
+// host; peripheral setup does nothing and data arrives by usart_inject.
+
+#ifndef _STM32F4XX_H
+#define _STM32F4XX_H
+
+#include <stdint.h>
+
+// ARM interrupt handlers are plain functions here.
+#define interrupt used
+
+typedef enum { RESET = 0, SET = !RESET } FlagStatus, ITStatus;
+typedef enum { DISABLE = 0, ENABLE = !DISABLE } FunctionalState;
+
+typedef struct { int unused; } GPIO_TypeDef;
+typedef struct { uint32_t BRR; } USART_TypeDef;
+
+extern GPIO_TypeDef sim_gpioa, sim_gpiob;
+extern USART_TypeDef sim_usart1;
+
+#define GPIOA (&sim_gpioa)
+#define GPIOB (&sim_gpiob)
+#define USART1 (&sim_usart1)
+
+#define USART1_IRQn 37
+
+typedef enum { GPIO_Mode_AF = 2 } GPIOMode_TypeDef;
+typedef enum { GPIO_Fast_Speed = 2 } GPIOSpeed_TypeDef;
+typedef enum { GPIO_OType_PP = 0 } GPIOOType_TypeDef;
+typedef enum { GPIO_PuPd_UP = 1 } GPIOPuPd_TypeDef;
+
+#define GPIO_AF_USART1 7
+
+typedef struct {
+	uint32_t GPIO_Pin;
+	GPIOMode_TypeDef GPIO_Mode;
+	GPIOSpeed_TypeDef GPIO_Speed;
+	GPIOOType_TypeDef GPIO_OType;
+	GPIOPuPd_TypeDef GPIO_PuPd;
+} GPIO_InitTypeDef;
+
+typedef struct {
+	uint32_t USART_BaudRate;
+} USART_InitTypeDef;
+
+#define USART_IT_RXNE 0x0525
+
+static inline void NVIC_DisableIRQ(int irq)
+{
+	(void) irq;
+}
+
+static inline void NVIC_EnableIRQ(int irq)
+{
+	(void) irq;
+}
+
+static inline void GPIO_Init(GPIO_TypeDef *g, GPIO_InitTypeDef *i)
+{
+	(void) g; (void) i;
+}
+
+static inline void GPIO_PinAFConfig(GPIO_TypeDef *g, uint16_t pin, uint8_t af)
+{
+	(void) g; (void) pin; (void) af;
+}
+
+static inline void USART_StructInit(USART_InitTypeDef *i)
+{
+	i->USART_BaudRate = 9600;
+}
+
+static inline void USART_Init(USART_TypeDef *u, USART_InitTypeDef *i)
+{
+	(void) u; (void) i;
+}
+
+static inline void USART_Cmd(USART_TypeDef *u, FunctionalState s)
+{
+	(void) u; (void) s;
+}
+
+static inline void USART_ITConfig(USART_TypeDef *u, uint16_t it,
+		FunctionalState s)
+{
+	(void) u; (void) it; (void) s;
+}
+
+static inline ITStatus USART_GetITStatus(USART_TypeDef *u, uint16_t it)
+{
+	(void) u; (void) it;
+
+	return RESET;
+}
+
+static inline uint16_t USART_ReceiveData(USART_TypeDef *u)
+{
+	(void) u;
+
+	return 0;
+}
+
+static inline void USART_SendData(USART_TypeDef *u, uint16_t data)
+{
+	(void) u; (void) data;
+}
+
+#endif /* _STM32F4XX_H */
@@ -0,0 +1,306 @@
+// Host decompressor for openlager compressed logs
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Expands a log written with "compress" set (see inc/lzblock.h) and
+// reports the compression ratio.  Gap markers between blocks are
+// reported and dropped; damaged blocks are reported and skipped, and
+// decoding picks up again at the next block header.  For a framed log,
+// run it on the payload from lagerframe -o.
+//
+// Build: g++ -O2 -std=c++11 -Iinc -o lagerunlz misc/lagerunlz.cpp
+// Usage: lagerunlz [-q] [-o raw.bin] log000.txt
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <logframe.h>
+#include <lzblock.h>
+
+static inline uint32_t get32(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint16_t get16(const uint8_t *p) {
+	return p[0] | (p[1] << 8);
+}
+
+// Decodes one LZ4 format block into out, which holds out_len bytes.
+// Returns false if the block is damaged or doesn't fill out exactly.
+static bool lz_decode(const uint8_t *in, size_t in_len,
+		uint8_t *out, size_t out_len) {
+	const uint8_t *ip = in, *iend = in + in_len;
+	uint8_t *op = out, *oend = out + out_len;
+
+	while (ip < iend) {
+		unsigned int token = *ip++;
+		size_t len = token >> 4;
+
+		if (len == 15) {
+			unsigned int b;
+
+			do {
+				if (ip >= iend) {
+					return false;
+				}
+
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+
+		if (len > (size_t) (iend - ip) || len > (size_t) (oend - op)) {
+			return false;
+		}
+
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		if (ip == iend) {
+			break;		// Last sequence is literals only
+		}
+
+		if (iend - ip < 2) {
+			return false;
+		}
+
+		size_t offset = get16(ip);
+		ip += 2;
+
+		if (offset == 0 || offset > (size_t) (op - out)) {
+			return false;
+		}
+
+		len = token & 15;
+
+		if (len == 15) {
+			unsigned int b;
+
+			do {
+				if (ip >= iend) {
+					return false;
+				}
+
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+
+		len += 4;
+
+		if (len > (size_t) (oend - op)) {
+			return false;
+		}
+
+		// May overlap; copy forwards a byte at a time.
+		const uint8_t *ref = op - offset;
+
+		for (size_t i = 0; i < len; i++) {
+			op[i] = ref[i];
+		}
+
+		op += len;
+	}
+
+	return op == oend;
+}
+
+static bool is_gap(const uint8_t *p) {
+	uint32_t magic = get32(p);
+
+	return magic == LOGGAP_MAGIC &&
+		get32(p + 12) == ~(magic ^ get32(p + 4) ^ get32(p + 8));
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr, "usage: %s [-q] [-o raw.bin] log\n", argv0);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	const char *out_name = NULL;
+	bool quiet = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "qo:")) != -1) {
+		switch (opt) {
+			case 'q':
+				quiet = true;
+				break;
+			case 'o':
+				out_name = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+	}
+
+	int fd = open(argv[optind], O_RDONLY);
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	size_t len = st.st_size;
+
+	if (len == 0) {
+		fprintf(stderr, "%s: empty\n", argv[optind]);
+		return 1;
+	}
+
+	const uint8_t *data = (const uint8_t *) mmap(NULL, len, PROT_READ,
+			MAP_PRIVATE, fd, 0);
+
+	if (data == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	madvise((void *) data, len, MADV_SEQUENTIAL);
+
+	FILE *out = NULL;
+
+	if (out_name) {
+		out = fopen(out_name, "wb");
+
+		if (!out) {
+			perror(out_name);
+			return 1;
+		}
+
+		setvbuf(out, NULL, _IOFBF, 1 << 20);
+	}
+
+	uint8_t block[LZBLOCK_MAX_RAW];
+	uint64_t blocks = 0, stored = 0, bad = 0, gaps = 0, dropped = 0;
+	uint64_t raw_bytes = 0, in_bytes = 0, skipped = 0;
+	size_t pos = 0;
+	bool resyncing = false;
+
+	while (pos + sizeof(struct lzblock) <= len) {
+		const uint8_t *p = data + pos;
+
+		if (pos + sizeof(struct loggap) <= len && is_gap(p)) {
+			if (!quiet) {
+				fprintf(stderr, "%12zu: receive gap: %u bytes "
+						"dropped at %u ms\n", pos,
+						get32(p + 8), get32(p + 4));
+			}
+
+			gaps++;
+			dropped += get32(p + 8);
+			pos += sizeof(struct loggap);
+			resyncing = false;
+			continue;
+		}
+
+		uint16_t raw_len = get16(p + 4);
+		uint16_t stored_len = get16(p + 6);
+		size_t clen = stored_len & ~LZBLOCK_STORED;
+		const uint8_t *body = p + sizeof(struct lzblock);
+		bool ok = get32(p) == LZBLOCK_MAGIC &&
+			raw_len <= LZBLOCK_MAX_RAW &&
+			clen <= len - pos - sizeof(struct lzblock);
+
+		if (ok && (stored_len & LZBLOCK_STORED)) {
+			ok = clen == raw_len;
+
+			if (ok) {
+				memcpy(block, body, raw_len);
+			}
+		} else if (ok) {
+			ok = lz_decode(body, clen, block, raw_len);
+		}
+
+		if (!ok) {
+			if (!resyncing) {
+				if (!quiet) {
+					fprintf(stderr, "%12zu: bad block, "
+							"resyncing\n", pos);
+				}
+
+				bad++;
+				resyncing = true;
+			}
+
+			skipped++;
+			pos++;
+			continue;
+		}
+
+		resyncing = false;
+
+		if (out && fwrite(block, 1, raw_len, out) != raw_len) {
+			perror("write");
+			return 1;
+		}
+
+		blocks++;
+
+		if (stored_len & LZBLOCK_STORED) {
+			stored++;
+		}
+
+		raw_bytes += raw_len;
+		in_bytes += sizeof(struct lzblock) + clen;
+		pos += sizeof(struct lzblock) + clen;
+	}
+
+	skipped += len - pos;
+
+	if (out && fclose(out)) {
+		perror(out_name);
+		return 1;
+	}
+
+	fprintf(stderr, "%llu blocks (%llu stored), %llu -> %llu bytes, "
+			"ratio %.2f\n",
+			(unsigned long long) blocks,
+			(unsigned long long) stored,
+			(unsigned long long) in_bytes,
+			(unsigned long long) raw_bytes,
+			in_bytes ? (double) raw_bytes / in_bytes : 0.0);
+	fprintf(stderr, "%llu bad blocks, %llu bytes skipped, "
+			"%llu receive gaps, %llu bytes dropped\n",
+			(unsigned long long) bad,
+			(unsigned long long) skipped,
+			(unsigned long long) gaps,
+			(unsigned long long) dropped);
+
+	return (bad || gaps) ? 2 : 0;
+}
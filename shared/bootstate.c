@@ -0,0 +1,276 @@
+// Program slots and boot state
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <stddef.h>
+
+#include <stm32f4xx_flash.h>
+
+#include <bootstate.h>
+#include <led.h>
+
+#define MAX_RECS (BOOTSTATE_BYTES / sizeof(struct bootrec))
+
+static const uint16_t log_sectors[NUM_LOGS] = {
+	FLASH_Sector_2, FLASH_Sector_3
+};
+
+static inline struct bootrec *log_recs(uint8_t log)
+{
+	return (struct bootrec *) (BOOTSTATE_ADDR + log * BOOTSTATE_BYTES);
+}
+
+// Whether a sector holds a log, and its number if so.
+static bool log_seq(uint8_t log, uint32_t *seq)
+{
+	const struct bootrec *rec = &log_recs(log)[0];
+
+	if (rec->magic != BOOTREC_MAGIC) {
+		return false;
+	}
+
+	*seq = (rec->type == BOOTREC_BEGIN) ? rec->fingerprint : 0;
+
+	return true;
+}
+
+static void apply_rec(struct boot_state *state, const struct bootrec *rec)
+{
+	struct boot_slot *slot = &state->slots[rec->slot];
+
+	switch (rec->type) {
+		case BOOTREC_IMAGE:
+			slot->known = true;
+			slot->failed = false;
+			slot->fingerprint = rec->fingerprint;
+			slot->size = rec->size;
+			slot->crc = rec->crc;
+
+			if (state->trial == rec->slot) {
+				state->trial = NO_SLOT;
+			}
+			break;
+		case BOOTREC_TRIAL:
+			state->trial = rec->slot;
+			state->attempts = 0;
+			break;
+		case BOOTREC_ATTEMPT:
+			state->attempts++;
+			break;
+		case BOOTREC_CONFIRM:
+			state->active = rec->slot;
+			state->trial = NO_SLOT;
+			slot->failed = false;
+			break;
+		case BOOTREC_REVERT:
+			slot->failed = true;
+			state->trial = NO_SLOT;
+			break;
+	}
+}
+
+static bool rec_erased(const struct bootrec *rec)
+{
+	const uint32_t *words = (const uint32_t *) rec;
+
+	for (unsigned int i = 0; i < sizeof(*rec) / sizeof(uint32_t); i++) {
+		if (words[i] != 0xffffffff) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void bootstate_load(struct boot_state *state)
+{
+	*state = (struct boot_state) {
+		// What's flashed by SWD, with nothing recorded, is in A.
+		.active = 0,
+		.trial = NO_SLOT,
+		// With no log anywhere, start one where older loaders did.
+		.log = NUM_LOGS - 1,
+	};
+
+	bool found = false;
+
+	for (uint8_t log = 0; log < NUM_LOGS; log++) {
+		uint32_t seq;
+
+		if (log_seq(log, &seq) &&
+				(!found || ((int32_t) (seq - state->seq) > 0))) {
+			state->log = log;
+			state->seq = seq;
+			found = true;
+		}
+	}
+
+	// The BEGIN record, if there is one, is skipped like any other
+	// this doesn't know.
+	const struct bootrec *recs = log_recs(state->log);
+
+	for (state->used = 0; state->used < MAX_RECS; state->used++) {
+		const struct bootrec *rec = &recs[state->used];
+
+		if (rec->magic != BOOTREC_MAGIC) {
+			// Past the end, unless it's a record a reset cut
+			// short; that's passed over rather than written on.
+			if (rec_erased(rec)) {
+				break;
+			}
+
+			continue;
+		}
+
+		if ((rec->slot < NUM_SLOTS) && (rec->type >= BOOTREC_IMAGE) &&
+				(rec->type <= BOOTREC_REVERT)) {
+			apply_rec(state, rec);
+		}
+	}
+}
+
+static void chk_flashop(FLASH_Status f)
+{
+	if (f != FLASH_COMPLETE) {
+		while (1) {
+			// ..-. . .-. .-.
+			led_panic("FERR");
+		}
+	}
+}
+
+// Magic goes last, so a record cut short by a reset is just ignored.
+static void write_rec(uint8_t log, unsigned int idx,
+		const struct bootrec *rec)
+{
+	const uint32_t *words = (const uint32_t *) rec;
+	uint32_t addr = (uint32_t) &log_recs(log)[idx];
+
+	for (unsigned int i = 1; i < sizeof(*rec) / sizeof(uint32_t); i++) {
+		if (words[i] != 0xffffffff) {
+			chk_flashop(FLASH_ProgramWord(addr + i * 4, words[i]));
+		}
+	}
+
+	chk_flashop(FLASH_ProgramWord(addr, words[0]));
+}
+
+static void fill_rec(struct bootrec *rec, const struct boot_state *state,
+		enum bootrec_type type, uint8_t slot)
+{
+	*rec = (struct bootrec) {
+		.magic = BOOTREC_MAGIC,
+		.type = type,
+		.slot = slot,
+		.reserved = 0xffff,
+		.pad = { 0xffffffff, 0xffffffff, 0xffffffff },
+	};
+
+	if (type == BOOTREC_IMAGE) {
+		rec->fingerprint = state->slots[slot].fingerprint;
+		rec->size = state->slots[slot].size;
+		rec->crc = state->slots[slot].crc;
+	} else {
+		rec->fingerprint = rec->size = rec->crc = 0xffffffff;
+	}
+}
+
+// The log is full: write just enough to get the same state on replay
+// into the other sector, then its BEGIN record, which makes it the
+// current log.  Until that's done the old log stands.
+static void compact(struct boot_state *state)
+{
+	struct bootrec rec;
+	uint8_t log = (state->log + 1) % NUM_LOGS;
+	unsigned int idx = 1;
+
+	chk_flashop(FLASH_EraseSector(log_sectors[log], VoltageRange_3));
+
+	for (uint8_t i = 0; i < NUM_SLOTS; i++) {
+		if (state->slots[i].known) {
+			fill_rec(&rec, state, BOOTREC_IMAGE, i);
+			write_rec(log, idx++, &rec);
+		}
+
+		if (state->slots[i].failed) {
+			fill_rec(&rec, state, BOOTREC_REVERT, i);
+			write_rec(log, idx++, &rec);
+		}
+	}
+
+	fill_rec(&rec, state, BOOTREC_CONFIRM, state->active);
+	write_rec(log, idx++, &rec);
+
+	if (state->trial != NO_SLOT) {
+		fill_rec(&rec, state, BOOTREC_TRIAL, state->trial);
+		write_rec(log, idx++, &rec);
+
+		for (int i = 0; i < state->attempts; i++) {
+			fill_rec(&rec, state, BOOTREC_ATTEMPT, state->trial);
+			write_rec(log, idx++, &rec);
+		}
+	}
+
+	fill_rec(&rec, state, BOOTREC_BEGIN, 0);
+	rec.fingerprint = state->seq + 1;
+	write_rec(log, 0, &rec);
+
+	state->log = log;
+	state->seq++;
+	state->used = idx;
+}
+
+// Records an event and applies it to state.  For BOOTREC_IMAGE, the
+// slot's fingerprint, size and CRC should already be filled in.
+void bootstate_append(struct boot_state *state, enum bootrec_type type,
+		uint8_t slot)
+{
+	struct bootrec rec;
+
+	FLASH_Unlock();
+
+	if (state->used >= MAX_RECS) {
+		compact(state);
+	}
+
+	fill_rec(&rec, state, type, slot);
+	write_rec(state->log, state->used++, &rec);
+
+	FLASH_Lock();
+
+	apply_rec(state, &rec);
+}
+
+// Compacts now if fewer than recs more records would fit, so appending
+// them later doesn't have to.
+void bootstate_reserve(struct boot_state *state, unsigned int recs)
+{
+	if (state->used + recs <= MAX_RECS) {
+		return;
+	}
+
+	FLASH_Unlock();
+	compact(state);
+	FLASH_Lock();
+}
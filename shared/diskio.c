@@ -4,10 +4,72 @@
 
 #include "diskio.h"             /* FatFs lower layer API */
 #include <sdio.h>               /* dRonin SDIO implementation functions */
+#include <disktrace.h>          /* Storage operation traces */
+
+#include <stddef.h>
+#include <timebase.h>
 
 /* Definitions of physical drive number for each drive */
 #define CARD            0       /* Example: Map ATA harddisk to physical drive 0 */
 
+/* Write transactions retried after an error, for runtime statistics */
+static DWORD write_retries;
+
+/* Operation trace; records go into trace_buf while it's set */
+static struct disk_trace_rec *trace_buf;
+static unsigned int trace_len;
+static unsigned int trace_count;
+static DWORD trace_lost;
+
+static void trace_op(DWORD sector, UINT count, uint16_t flags,
+		uint32_t start)
+{
+	if (!trace_buf)
+		return;
+
+	if (trace_count >= trace_len) {
+		trace_lost++;
+		return;
+	}
+
+	struct disk_trace_rec *rec = &trace_buf[trace_count++];
+
+	rec->lba = sector;
+	rec->sectors = (count > 0xffff) ? 0xffff : count;
+	rec->flags = flags;
+	rec->cycles = timebase_us() - start;
+}
+
+void disk_trace_start(struct disk_trace_rec *buf, unsigned int len)
+{
+	trace_count = 0;
+	trace_len = len;
+
+	if (buf && len && trace_lost) {
+		buf[0].lba = trace_lost;
+		buf[0].sectors = 0;
+		buf[0].flags = DISK_TRACE_LOST;
+		buf[0].cycles = 0;
+
+		trace_count = 1;
+		trace_lost = 0;
+	}
+
+	trace_buf = buf;
+}
+
+unsigned int disk_trace_stop(void)
+{
+	trace_buf = NULL;
+
+	return trace_count;
+}
+
+bool disk_trace_full(void)
+{
+	return trace_buf && (trace_count >= trace_len);
+}
+
 /*-----------------------------------------------------------------------*/
 /* Get Drive Status                                                      */
 /*-----------------------------------------------------------------------*/
@@ -51,24 +113,48 @@ DRESULT disk_read(
 		return RES_PARERR;
 
 	BYTE *rptr = buff;
+	uint32_t start = timebase_us();
+	uint16_t flags = 0;
+
+	/* Multiple sectors go by DMA, at most 64 (32K) per command so a
+	 * retry doesn't cost too much. */
+	uint16_t reading = 64;
 
-	for (UINT i = 0; i < count; i++) {
+	for (UINT i = 0; i < count; i += reading) {
 		int retries = 3;
 
+		uint16_t left = count - i;
+
+		if (reading > left) {
+			reading = left;
+		}
+
 retry:;
-		int ret = sd_read(rptr, sector + i);
+		int ret;
+
+		if (reading == 1) {
+			ret = sd_read(rptr, sector + i);
+		} else {
+			ret = sd_read_multi(rptr, sector + i, reading);
+		}
 
 		if (ret) {
 			if (retries--) {
+				flags |= DISK_TRACE_RETRIED;
 				goto retry;
 			}
 
+			trace_op(sector, count, flags | DISK_TRACE_FAILED,
+					start);
+
 			return RES_ERROR;
 		}
 
-		rptr += 512;
+		rptr += 512 * reading;
 	}
 
+	trace_op(sector, count, flags, start);
+
 	return RES_OK;
 }
 
@@ -87,6 +173,8 @@ DRESULT disk_write(
 		return RES_PARERR;
 
 	const BYTE *wptr = buff;
+	uint32_t start = timebase_us();
+	uint16_t flags = DISK_TRACE_WRITE;
 
 	/* never do more than 6144 bytes in a txn for now.
 	 * This is enough to get a significant boost over doing 512 at a
@@ -109,15 +197,22 @@ retry:;
 
 		if (ret) {
 			if (retries--) {
+				write_retries++;
+				flags |= DISK_TRACE_RETRIED;
 				goto retry;
 			}
 
+			trace_op(sector, count, flags | DISK_TRACE_FAILED,
+					start);
+
 			return RES_ERROR;
 		}
 
 		wptr += 512 * writing;
 	}
 
+	trace_op(sector, count, flags, start);
+
 	return RES_OK;
 }
 
@@ -137,5 +232,36 @@ DRESULT disk_ioctl(
 	if (cmd == CTRL_SYNC)
 		return RES_OK;
 
+	if (cmd == GET_WRITE_RETRIES) {
+		*(DWORD *) buff = write_retries;
+
+		return RES_OK;
+	}
+
+	if (cmd == GET_SECTOR_COUNT) {
+		*(DWORD *) buff = sd_get_sectors();
+
+		return RES_OK;
+	}
+
+	if (cmd == GET_BLOCK_SIZE) {
+		/* Erase block size in sectors, as FatFs expects-- we use the
+		 * card's AU.  f_mkfs wants a power of 2 up to 32768 */
+		uint32_t au;
+
+		if (sd_get_au_sectors(&au))
+			return RES_ERROR;
+
+		while (au & (au - 1))
+			au &= au - 1;
+
+		if (au > 32768)
+			au = 32768;
+
+		*(DWORD *) buff = au ? au : 1;
+
+		return RES_OK;
+	}
+
 	return RES_PARERR;
 }
@@ -0,0 +1,53 @@
+// Loader to application handoff
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <stddef.h>
+
+#include <handoff.h>
+
+struct handoff boot_handoff __attribute__((section(".handoff")));
+
+static uint32_t handoff_check(const struct handoff *h)
+{
+	const uint32_t *words = (const uint32_t *) h;
+	uint32_t check = 0;
+
+	for (unsigned int i = 0; i < offsetof(struct handoff, check) / 4; i++) {
+		check = (check << 5 | check >> 27) ^ words[i];
+	}
+
+	return ~check;
+}
+
+void handoff_seal(struct handoff *h)
+{
+	h->magic = HANDOFF_MAGIC;
+	h->check = handoff_check(h);
+}
+
+bool handoff_valid(const struct handoff *h)
+{
+	return (h->magic == HANDOFF_MAGIC) && (h->check == handoff_check(h));
+}
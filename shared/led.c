@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include <led.h>
 #include <systick_handler.h>
 #include <morsel.h>
@@ -7,12 +9,26 @@ static uint16_t led_pin;
 static bool led_sense;
 static int led_time_per_dot = 36;
 
-void led_toggle()
-{
-	GPIO_ToggleBits(led_gpio, led_pin);
-}
+// Morse is sent from the systick handler, a symbol per dot time, so
+// nothing has to wait on it: led_queue_morse adds to what's waiting.
+// When there's nothing to send, the LED shows the idle pattern--
+// whatever led_set last asked for, or a fill level from led_show_fill.
+#define LED_QUEUE_LEN 128
 
-void led_set(bool light)
+// Fill is shown as the lit fraction of this many ticks (~250ms).
+#define LED_FILL_PERIOD 64
+
+static char led_queue[LED_QUEUE_LEN];
+static char * volatile led_pos;		// Next to send; NULL when idle
+static uint32_t led_morse_state;
+static int led_dot_ticks;
+
+static bool led_idle_light;
+static bool led_fill_shown;
+static uint8_t led_fill_ticks;
+static uint8_t led_fill_phase;
+
+static void led_drive(bool light)
 {
 	if (led_sense ^ light) {
 		GPIO_SetBits(led_gpio, led_pin);
@@ -21,26 +37,116 @@ void led_set(bool light)
 	}
 }
 
-void led_send_morse(char *string)
+void led_toggle()
+{
+	led_set(!led_idle_light);
+}
+
+void led_set(bool light)
 {
-	char *pos = string;
-	int val;
+	led_idle_light = light;
+	led_fill_shown = false;
+
+	if (!led_pos) {
+		led_drive(light);
+	}
+}
+
+// Shows fill out of max as the idle pattern: a flicker when nearly
+// empty, near solid when nearly full.
+void led_show_fill(unsigned int fill, unsigned int max)
+{
+	unsigned int ticks = 1;
+
+	if (max) {
+		ticks += (uint64_t) fill * (LED_FILL_PERIOD - 1) / max;
+	}
+
+	led_fill_ticks = (ticks < LED_FILL_PERIOD) ? ticks : LED_FILL_PERIOD;
+	led_fill_shown = true;
+}
+
+// From the systick handler.
+void led_tick(void)
+{
+	if (!led_gpio) {
+		return;
+	}
 
-	uint32_t state = 0;
+	if (led_pos) {
+		if (--led_dot_ticks > 0) {
+			return;
+		}
 
-	uint32_t next = systick_cnt;
+		led_dot_ticks = led_time_per_dot;
 
-	while ((val = morse_send(&pos, &state)) != -1) {
-		while (systick_cnt < next);
+		int val = morse_send((char **) &led_pos, &led_morse_state);
 
-		next += led_time_per_dot;
+		if (val != -1) {
+			led_drive(val > 0);
+			return;
+		}
 
-		led_set(val > 0);
+		led_pos = NULL;
+	}
+
+	if (led_fill_shown) {
+		led_fill_phase = (led_fill_phase + 1) % LED_FILL_PERIOD;
+		led_drive(led_fill_phase < led_fill_ticks);
+	} else {
+		led_drive(led_idle_light);
 	}
 }
 
+// Adds to what's to be sent; what doesn't fit is dropped.
+void led_queue_morse(char *string)
+{
+	__disable_irq();
+
+	unsigned int used = 0;
+
+	if (led_pos) {
+		// Move what's left to the front, to make room.
+		used = strlen(led_pos);
+		memmove(led_queue, led_pos, used + 1);
+	} else {
+		led_morse_state = 0;
+		led_dot_ticks = 0;
+	}
+
+	unsigned int len = strlen(string);
+
+	if (len > LED_QUEUE_LEN - 1 - used) {
+		len = LED_QUEUE_LEN - 1 - used;
+	}
+
+	memcpy(led_queue + used, string, len);
+	led_queue[used + len] = 0;
+
+	led_pos = led_queue;
+
+	__enable_irq();
+}
+
+bool led_busy(void)
+{
+	return led_pos != NULL;
+}
+
+void led_send_morse(char *string)
+{
+	led_queue_morse(string);
+
+	while (led_busy());
+}
+
 void led_panic(char *string)
 {
+	// Whatever was waiting to be sent doesn't matter now.
+	__disable_irq();
+	led_pos = NULL;
+	__enable_irq();
+
 	while (true) {
 		led_send_morse(string);
 		led_send_morse("  ");
@@ -30,9 +30,21 @@
 #include <mmcreg.h>
 
 #include <led.h>
+#include <timebase.h>
+
+// Timeouts.  Commands get their response in 64 card clocks, and the
+// peripheral flags that itself; this is a backstop.  Cards have a second
+// to finish powering up, and 500ms (SDXC) to finish a write.
+#define SD_CMD_TIMEOUT_US 100000
+#define SD_POWERUP_TIMEOUT_US 1000000
+#define SD_BUSY_TIMEOUT_US 500000
+#define SD_DMA_DRAIN_TIMEOUT_US 10000
 
 static uint16_t sd_rca;
 static bool sd_high_cap;
+static bool sd_four_bit;
+static uint32_t sd_sectors;
+static uint32_t sd_cid[4];
 
 // XXX / todo error codes
 
@@ -74,12 +86,12 @@ static int sd_waitcomplete(uint32_t response_type)
 		completion_mask |= SDIO_FLAG_CMDSENT;
 	}
 
-	int timeout = 1500000;
+	uint32_t deadline = timebase_deadline(SD_CMD_TIMEOUT_US);
 
 	do {
 		status = SDIO->STA;
 
-		if (timeout-- < 0) {
+		if (timebase_expired(deadline)) {
 			return -1;
 		}
 
@@ -237,11 +249,54 @@ static int sd_getrca(uint16_t *rca)
 	return 0;
 }
 
+/* Sends CMD9, SEND_CSD, and works out the card capacity from it */
+static int sd_getcapacity(uint32_t *sectors)
+{
+	if (sd_sendcmd(MMC_SEND_CSD, sd_rca << 16, MMC_RSP_R2)) {
+		return -1;
+	}
+
+	uint32_t resp1 = SDIO_GetResponse(SDIO_RESP1);	/* [127:96] */
+	uint32_t resp2 = SDIO_GetResponse(SDIO_RESP2);	/* [95:64] */
+	uint32_t resp3 = SDIO_GetResponse(SDIO_RESP3);	/* [63:32] */
+
+	if ((resp1 >> 30) == 1) {
+		/* CSD version 2: C_SIZE [69:48], in units of 512KB */
+		uint32_t c_size = ((resp2 & 0x3f) << 16) | (resp3 >> 16);
+
+		*sectors = (c_size + 1) * 1024;
+	} else {
+		/* CSD version 1: READ_BL_LEN [83:80], C_SIZE [73:62],
+		 * C_SIZE_MULT [49:47] */
+		uint32_t read_bl_len = (resp2 >> 16) & 0xf;
+		uint32_t c_size = ((resp2 & 0x3ff) << 2) | (resp3 >> 30);
+		uint32_t c_size_mult = (resp3 >> 15) & 0x7;
+
+		*sectors = (c_size + 1) << (c_size_mult + 2 + read_bl_len - 9);
+	}
+
+	return 0;
+}
+
 static int sd_checkbusy()
 {
 	return sd_cmdtype1(MMC_SEND_STATUS, sd_rca << 16);
 }
 
+// Waits for the card to be ready for data; -1 if it stays busy too long.
+static int sd_waitready()
+{
+	uint32_t deadline = timebase_deadline(SD_BUSY_TIMEOUT_US);
+
+	while (sd_checkbusy() > 0) {
+		if (timebase_expired(deadline)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 static inline void sd_send_morse(char *morse)
 {
 #if 0
@@ -249,7 +304,7 @@ static inline void sd_send_morse(char *morse)
 #endif
 }
 
-int sd_init(bool fourbit)
+static void sd_start_periph(SDIO_InitTypeDef *sd_settings)
 {
 	// Clocks programmed elsewhere and peripheral/GPIO clock enabled already
 
@@ -264,6 +319,26 @@ int sd_init(bool fourbit)
 	sd_initpin(GPIOB, 7);
 	sd_initpin(GPIOB, 15);
 
+	SDIO_Init(sd_settings);
+
+	// Turn it on and enable the clock
+	SDIO_SetPowerState(SDIO_PowerState_ON);
+
+	SDIO_ClockCmd(ENABLE);
+
+	// The end of a transfer (or its failure) raises SDIO's interrupt,
+	// which is left disabled in the NVIC: with SEVONPEND, it becoming
+	// pending is just an event, to wake sd_waitdataend from WFE.
+	SDIO_ITConfig(SDIO_IT_DATAEND | SDIO_IT_CCRCFAIL | SDIO_IT_DCRCFAIL |
+			SDIO_IT_CTIMEOUT | SDIO_IT_DTIMEOUT |
+			SDIO_IT_TXUNDERR | SDIO_IT_RXOVERR |
+			SDIO_IT_STBITERR, ENABLE);
+
+	SCB->SCR |= SCB_SCR_SEVONPEND_Msk;
+}
+
+int sd_init(bool fourbit)
+{
 	// Take, then fix up default settings to talk slow.
 	SDIO_InitTypeDef sd_settings;
 	SDIO_StructInit(&sd_settings);
@@ -285,14 +360,10 @@ int sd_init(bool fourbit)
 	// sd_settings.SDIO_HardwareFlowControl = SDIO_HardwareFlowControl_Enable;
 	// sd_settings.SDIO_ClockPowerSave = SDIO_ClockPowerSave_Enable;
 
-	SDIO_Init(&sd_settings);
-
-	// Turn it on and enable the clock
-	SDIO_SetPowerState(SDIO_PowerState_ON);
-
-	SDIO_ClockCmd(ENABLE);
+	sd_start_periph(&sd_settings);
 
 	sd_high_cap = false;
+	sd_four_bit = false;
 
 	// The SD card negotiation and selection sequence is annoying.
 
@@ -311,10 +382,10 @@ int sd_init(bool fourbit)
 
 	// A-CMD41 SD_SEND_OP_COND -- may return busy, need to loop
 	uint32_t ocr;
-	int tries = 10000;
+	uint32_t deadline = timebase_deadline(SD_POWERUP_TIMEOUT_US);
 
 	do {
-		if (tries-- < 0) {
+		if (timebase_expired(deadline)) {
 			return -1;
 		}
 
@@ -336,13 +407,22 @@ int sd_init(bool fourbit)
 		return -1;
 	}
 
-	/* We don't care about the response / CID now. */
+	/* Keep the CID, to tell this card from others */
+	sd_cid[0] = SDIO_GetResponse(SDIO_RESP1);
+	sd_cid[1] = SDIO_GetResponse(SDIO_RESP2);
+	sd_cid[2] = SDIO_GetResponse(SDIO_RESP3);
+	sd_cid[3] = SDIO_GetResponse(SDIO_RESP4);
 
 	/* But we -do- care about getting the RCA so we can talk to the card */
 	if (sd_getrca(&sd_rca)) {
 		return -1;
 	}
 
+	/* And the CSD has to be fetched before the card is selected */
+	if (sd_getcapacity(&sd_sectors)) {
+		return -1;
+	}
+
 	// Now that the card is inited.. crank the bus speed up!
 	sd_settings.SDIO_ClockDiv = 0;          // /2; = 24MHz at 48MHz
 	                                        // and 19.2MHz at 38.4MHz
@@ -370,17 +450,71 @@ int sd_init(bool fourbit)
 
 		sd_settings.SDIO_BusWide = SDIO_BusWide_4b;
 		SDIO_Init(&sd_settings);
+
+		sd_four_bit = true;
 	}
 
 	// If we got here, we won.. I think.
 	return 0;
 }
 
-static void sd_config_dma_tx(const void *src, uint32_t buf_size) {
-	uintptr_t raw_src = (uintptr_t) src;
+void sd_get_card_state(struct sd_card_state *state)
+{
+	for (int i = 0; i < 4; i++) {
+		state->cid[i] = sd_cid[i];
+	}
+
+	state->sectors = sd_sectors;
+	state->rca = sd_rca;
+	state->high_cap = sd_high_cap;
+	state->four_bit = sd_four_bit;
+}
+
+/* Picks up a card that sd_init set up earlier-- e.g. in the loader--
+ * and left selected.  Only the SDIO peripheral is set up again; the card
+ * has to answer at its old address, ready for transfers.  Otherwise it
+ * fails, and sd_init is needed after all. */
+int sd_resume(const struct sd_card_state *state)
+{
+	SDIO_InitTypeDef sd_settings;
+	SDIO_StructInit(&sd_settings);
+
+	sd_settings.SDIO_ClockDiv = 0;		// Full speed, as sd_init ends
+
+	if (state->four_bit) {
+		sd_settings.SDIO_BusWide = SDIO_BusWide_4b;
+	}
+
+	sd_start_periph(&sd_settings);
+
+	for (int i = 0; i < 4; i++) {
+		sd_cid[i] = state->cid[i];
+	}
+
+	sd_sectors = state->sectors;
+	sd_rca = state->rca;
+	sd_high_cap = state->high_cap;
+	sd_four_bit = state->four_bit;
+
+	if (sd_sendcmd(MMC_SEND_STATUS, sd_rca << 16, MMC_RSP_R1)) {
+		return -1;
+	}
+
+	uint32_t card_status = SDIO_GetResponse(SDIO_RESP1);
+
+	if (R1_STATUS(card_status) ||
+			(R1_CURRENT_STATE(card_status) != R1_STATE_TRAN)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static void sd_config_dma(const void *mem, uint32_t buf_size, bool to_card) {
+	uintptr_t raw_mem = (uintptr_t) mem;
 	bool aligned = true;
 
-	if ((raw_src & 3) || (buf_size & 3))  {
+	if ((raw_mem & 3) || (buf_size & 3))  {
 		aligned = false;
 	}
 
@@ -395,8 +529,9 @@ static void sd_config_dma_tx(const void *src, uint32_t buf_size) {
 
 	dma_init.DMA_Channel = DMA_Channel_4;
 	dma_init.DMA_PeripheralBaseAddr = (uintptr_t) &SDIO->FIFO;
-	dma_init.DMA_Memory0BaseAddr = raw_src;
-	dma_init.DMA_DIR = DMA_DIR_MemoryToPeripheral;
+	dma_init.DMA_Memory0BaseAddr = raw_mem;
+	dma_init.DMA_DIR = to_card ? DMA_DIR_MemoryToPeripheral :
+		DMA_DIR_PeripheralToMemory;
 	dma_init.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
 	dma_init.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word;
 	dma_init.DMA_MemoryInc = DMA_MemoryInc_Enable;
@@ -430,6 +565,41 @@ static void sd_config_dma_tx(const void *src, uint32_t buf_size) {
 	DMA_Cmd(DMA2_Stream6, ENABLE);
 }
 
+/* Waits for a DMA data transfer to finish or fail */
+static int sd_waitdataend(void)
+{
+	while (true) {
+		uint32_t status = SDIO->STA;
+
+		if (status &
+				(SDIO_STA_CCRCFAIL | SDIO_STA_DCRCFAIL |
+				SDIO_STA_CTIMEOUT | SDIO_STA_DTIMEOUT |
+				SDIO_STA_TXUNDERR | SDIO_STA_RXOVERR |
+				SDIO_STA_STBITERR)) {
+			if (status & SDIO_STA_DTIMEOUT) {
+				sd_send_morse("DTM");
+			} else if (status & SDIO_STA_CTIMEOUT) {
+				sd_send_morse("CTM");
+			} else if (status & SDIO_STA_DCRCFAIL) {
+				sd_send_morse("DCRCFAIL");
+			} else {
+				sd_send_morse("WFLAG ");
+			}
+			return -1;       /* we lose. */
+		}
+
+		if (status & SDIO_STA_DATAEND) {
+			return 0;        /* Sounds good! */
+		}
+
+		// Sleep while DMA does the work.  If the transfer ends
+		// after the status read, the event's already set, and this
+		// doesn't sleep.
+		NVIC_ClearPendingIRQ(SDIO_IRQn);
+		__WFE();
+	}
+}
+
 int sd_write(const uint8_t *data, uint32_t sect_num, uint16_t num_to_write)
 {
 	if (!(sd_high_cap)) {
@@ -440,7 +610,9 @@ int sd_write(const uint8_t *data, uint32_t sect_num, uint16_t num_to_write)
 		sect_num *= 512;
 	}
 
-	while (sd_checkbusy() > 0);
+	if (sd_waitready()) {
+		return -1;
+	}
 
 	int ret;
 
@@ -469,7 +641,7 @@ int sd_write(const uint8_t *data, uint32_t sect_num, uint16_t num_to_write)
 
 	// Ref manual suggests we should do this immediately above but here
 	// makes more sense to me.
-	sd_config_dma_tx(data, num_to_write * 512);
+	sd_config_dma(data, num_to_write * 512, true);
 
 	SDIO_DataInitTypeDef data_xfer = {
 		.SDIO_DataTimeOut = 50000000,  /* 1 secondish at full clk */
@@ -483,32 +655,7 @@ int sd_write(const uint8_t *data, uint32_t sect_num, uint16_t num_to_write)
 	SDIO_DataConfig(&data_xfer);
 	SDIO_DMACmd(ENABLE);
 
-	while (true) {
-		uint32_t status = SDIO->STA;
-
-		if (status &
-				(SDIO_STA_CCRCFAIL | SDIO_STA_DCRCFAIL |
-				SDIO_STA_CTIMEOUT | SDIO_STA_DTIMEOUT |
-				SDIO_STA_TXUNDERR | SDIO_STA_RXOVERR |
-				SDIO_STA_STBITERR)) {
-			if (status & SDIO_STA_DTIMEOUT) {
-				sd_send_morse("DTM");
-			} else if (status & SDIO_STA_CTIMEOUT) {
-				sd_send_morse("CTM");
-			} else if (status & SDIO_STA_DCRCFAIL) {
-				sd_send_morse("DCRCFAIL");
-			} else {
-				sd_send_morse("WFLAG ");
-			}
-			ret = -1;       /* we lose. */
-			break;
-		}
-
-		if (status & SDIO_STA_DATAEND) {
-			ret = 0;        /* Sounds good! */
-			break;
-		}
-	}
+	ret = sd_waitdataend();
 
 	DMA_Cmd(DMA2_Stream6, DISABLE);
 
@@ -526,38 +673,11 @@ int sd_write(const uint8_t *data, uint32_t sect_num, uint16_t num_to_write)
 	return ret;
 }
 
-int sd_read(uint8_t *data, uint32_t sect_num)
+/* Polls the data out of the FIFO once a read's been cued up */
+static int sd_readdata(uint8_t *data, uint32_t len)
 {
-	while (sd_checkbusy() > 0);
-
-	if (!(sd_high_cap)) {
-		if (sect_num > 0x7fffff) {
-			return -1;
-		}
-
-		sect_num *= 512;
-	}
-
-	/* config data transfer and cue up the data xfer state machine */
-	SDIO_DataInitTypeDef data_xfer = {
-		.SDIO_DataTimeOut = 50000000,  /* 1 secondish at full clk */
-		.SDIO_DataLength = 512,
-		.SDIO_DataBlockSize = 9 << 4,
-			.SDIO_TransferDir = SDIO_TransferDir_ToSDIO,
-			.SDIO_TransferMode = SDIO_TransferMode_Block,
-			.SDIO_DPSM = SDIO_DPSM_Enable
-	};
-
-	SDIO_DataConfig(&data_xfer);
-
-	int ret = sd_cmdtype1(MMC_READ_SINGLE_BLOCK, sect_num);
-
-	if (ret < 0) {
-		sd_send_morse("CMDFAIL ");
-		return ret;
-	}
-
-	int i = 512 / 4;
+	int ret;
+	int i = len / 4;
 
 	while (true) {
 		uint32_t status = SDIO->STA;
@@ -614,3 +734,154 @@ int sd_read(uint8_t *data, uint32_t sect_num)
 
 	return ret;
 }
+
+int sd_read(uint8_t *data, uint32_t sect_num)
+{
+	if (sd_waitready()) {
+		return -1;
+	}
+
+	if (!(sd_high_cap)) {
+		if (sect_num > 0x7fffff) {
+			return -1;
+		}
+
+		sect_num *= 512;
+	}
+
+	/* config data transfer and cue up the data xfer state machine */
+	SDIO_DataInitTypeDef data_xfer = {
+		.SDIO_DataTimeOut = 50000000,  /* 1 secondish at full clk */
+		.SDIO_DataLength = 512,
+		.SDIO_DataBlockSize = 9 << 4,
+			.SDIO_TransferDir = SDIO_TransferDir_ToSDIO,
+			.SDIO_TransferMode = SDIO_TransferMode_Block,
+			.SDIO_DPSM = SDIO_DPSM_Enable
+	};
+
+	SDIO_DataConfig(&data_xfer);
+
+	int ret = sd_cmdtype1(MMC_READ_SINGLE_BLOCK, sect_num);
+
+	if (ret < 0) {
+		sd_send_morse("CMDFAIL ");
+		return ret;
+	}
+
+	return sd_readdata(data, 512);
+}
+
+/* Multiple block read, by DMA.  Only worth it for more than one block;
+ * sd_read polls a single block out of the FIFO. */
+int sd_read_multi(uint8_t *data, uint32_t sect_num, uint16_t num_to_read)
+{
+	if (sd_waitready()) {
+		return -1;
+	}
+
+	if (!(sd_high_cap)) {
+		if (sect_num > 0x7fffff) {
+			return -1;
+		}
+
+		sect_num *= 512;
+	}
+
+	sd_config_dma(data, num_to_read * 512, false);
+
+	SDIO_DataInitTypeDef data_xfer = {
+		.SDIO_DataTimeOut = 50000000,  /* 1 secondish at full clk */
+		.SDIO_DataLength = num_to_read * 512,
+		.SDIO_DataBlockSize = 9 << 4,
+		.SDIO_TransferDir = SDIO_TransferDir_ToSDIO,
+		.SDIO_TransferMode = SDIO_TransferMode_Block,
+		.SDIO_DPSM = SDIO_DPSM_Enable
+	};
+
+	SDIO_DataConfig(&data_xfer);
+	SDIO_DMACmd(ENABLE);
+
+	int ret = sd_cmdtype1(MMC_READ_MULTIPLE_BLOCK, sect_num);
+
+	if (ret >= 0) {
+		ret = sd_waitdataend();
+	}
+
+	if (!ret) {
+		/* The stream finishes on its own once the peripheral says
+		 * it's done and the DMA FIFO has drained to memory. */
+		uint32_t deadline = timebase_deadline(SD_DMA_DRAIN_TIMEOUT_US);
+
+		while (DMA_GetCmdStatus(DMA2_Stream6) == ENABLE) {
+			if (timebase_expired(deadline)) {
+				ret = -1;
+				break;
+			}
+		}
+	}
+
+	DMA_Cmd(DMA2_Stream6, DISABLE);
+
+	sd_clearflags();
+
+	sd_cmdtype1(MMC_STOP_TRANSMISSION, 0);
+
+	return ret < 0 ? -1 : 0;
+}
+
+uint32_t sd_get_sectors(void)
+{
+	return sd_sectors;
+}
+
+/* Reads the 512 bit SD status with ACMD13, and decodes the allocation
+ * unit (AU) size from it-- the card's erase/housekeeping granularity.
+ * Returns 0 and *au_sectors = 0 if the card doesn't say. */
+int sd_get_au_sectors(uint32_t *au_sectors)
+{
+	/* AU_SIZE codes 0xB..0xF aren't powers of two, in MB */
+	static const uint8_t au_mb[] = { 12, 16, 24, 32, 64 };
+
+	uint8_t status[64];
+
+	if (sd_waitready()) {
+		return -1;
+	}
+
+	int ret = sd_cmdtype1(MMC_APP_CMD, sd_rca << 16);
+
+	if (ret < 0) return ret;
+
+	SDIO_DataInitTypeDef data_xfer = {
+		.SDIO_DataTimeOut = 50000000,
+		.SDIO_DataLength = sizeof(status),
+		.SDIO_DataBlockSize = 6 << 4,
+		.SDIO_TransferDir = SDIO_TransferDir_ToSDIO,
+		.SDIO_TransferMode = SDIO_TransferMode_Block,
+		.SDIO_DPSM = SDIO_DPSM_Enable
+	};
+
+	SDIO_DataConfig(&data_xfer);
+
+	ret = sd_cmdtype1(ACMD_SD_STATUS, 0);
+
+	if (ret < 0) return ret;
+
+	ret = sd_readdata(status, sizeof(status));
+
+	if (ret) return ret;
+
+	/* Status is sent MSB first; AU_SIZE is bits [431:428] */
+	uint8_t au = status[10] >> 4;
+
+	if (au == 0) {
+		*au_sectors = 0;
+	} else if (au <= 0xA) {
+		/* 16KB << (au - 1) */
+		*au_sectors = 32 << (au - 1);
+	} else {
+		*au_sectors = au_mb[au - 0xB] * 2048;
+	}
+
+	return 0;
+}
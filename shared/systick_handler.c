@@ -24,6 +24,10 @@
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 //
 
+#include <stm32f4xx_iwdg.h>
+
+#include <led.h>
+
 #include <systick_handler.h>
 
 static void systick_handler() __attribute__((interrupt));
@@ -31,8 +35,18 @@ static void systick_handler() __attribute__((interrupt));
 static void systick_handler()
 {
 	systick_cnt++;
+
+	led_tick();
+
+	if (systick_feed_watchdog) {
+		IWDG_ReloadCounter();
+	}
 }
 
 const void *_systick_vector __attribute((section(".systick_vector"))) = systick_handler;
 
 volatile uint32_t systick_cnt;
+
+// The watchdog the loader starts for a trial boot can't be stopped; once
+// the program's confirmed it came up, it's fed from here.
+volatile bool systick_feed_watchdog;
@@ -0,0 +1,57 @@
+// Microsecond timebase and cycle counter
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <stm32f4xx_tim.h>
+
+#include <timebase.h>
+
+uint32_t timebase_cycles_per_us;
+
+// timer_hz is what TIM5 is clocked at (APB1's clock, doubled if APB1 is
+// divided down); cpu_hz is the core clock.  Called again when the clocks
+// change; the count carries on from where it was.  timer_hz should be
+// whole MHz, or the count runs fast or slow; it's rounded to the
+// nearest.
+void timebase_init(uint32_t timer_hz, uint32_t cpu_hz)
+{
+	TIM_TimeBaseInitTypeDef tb = {
+		.TIM_Prescaler = (timer_hz + 500000) / 1000000 - 1,
+		.TIM_CounterMode = TIM_CounterMode_Up,
+		.TIM_Period = 0xffffffff,
+		.TIM_ClockDivision = TIM_CKD_DIV1,
+		.TIM_RepetitionCounter = 0
+	};
+
+	uint32_t count = TIM5->CNT;
+
+	TIM_TimeBaseInit(TIM5, &tb);
+	TIM_SetCounter(TIM5, count);
+	TIM_Cmd(TIM5, ENABLE);
+
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	timebase_cycles_per_us = cpu_hz / 1000000;
+}
@@ -23,11 +23,14 @@
 // (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#include <string.h>
+
 #include <stm32f4xx.h>
 #include <misc.h>
 
 #include <usart.h>
 #include <systick_handler.h>
+#include <timebase.h>
 
 #define OUR_USART USART1
 #define TXPORT GPIOA
@@ -42,6 +45,33 @@ static volatile unsigned int usart_rx_buf_wpos;
 static volatile unsigned int usart_rx_buf_rpos;
 static unsigned int usart_rx_buf_next_rpos;
 
+// Each overflow episode-- a run of dropped bytes-- is queued here with
+// the buffer position where it happened, so the reader can tell where the
+// hole is.  If the queue fills, further drops are added to the newest
+// episode.
+#define NUM_GAPS 8
+
+static volatile struct {
+	unsigned int pos;
+	uint32_t time;
+	unsigned int bytes;
+} usart_gaps[NUM_GAPS];
+
+static volatile unsigned int usart_gaps_wr;	// Episodes started
+static volatile unsigned int usart_gaps_rd;	// Episodes reported
+static volatile bool usart_in_gap;
+
+// Most received data seen waiting in the buffer at once; kept by the
+// interrupt as each byte is stored.
+static volatile unsigned int usart_rx_high_water;
+
+static uint32_t usart_baud;
+
+// Called while usart_receive_chunk waits, and (once armed) from the
+// interrupt when the next byte arrives; for power saving.
+static void (*usart_idle)(void);
+static void (* volatile usart_wake)(void);
+
 static void usart_initpin(GPIO_TypeDef *gpio, uint16_t pin_pos)
 {
 	GPIO_InitTypeDef pin_def = {
@@ -66,6 +96,45 @@ static inline unsigned int advance_pos(unsigned int cur_pos, unsigned int amt)
 	return cur_pos;
 }
 
+static inline void usart_rx_store(unsigned char c)
+{
+	unsigned int wpos = usart_rx_buf_wpos;
+	unsigned int next_wpos = advance_pos(wpos, 1);
+
+	unsigned int rpos = usart_rx_buf_rpos;
+
+	if (next_wpos == rpos) {
+		usart_rx_spilled++;
+		usart_rx_high_water = usart_rx_buf_len - 1;
+
+		unsigned int g = usart_gaps_wr;
+
+		if (!usart_in_gap && (g - usart_gaps_rd < NUM_GAPS)) {
+			usart_gaps[g % NUM_GAPS].pos = wpos;
+			usart_gaps[g % NUM_GAPS].time = systick_cnt;
+			usart_gaps[g % NUM_GAPS].bytes = 0;
+			usart_gaps_wr = ++g;
+		}
+
+		usart_in_gap = true;
+		usart_gaps[(g - 1) % NUM_GAPS].bytes++;
+
+		return;
+	}
+
+	usart_in_gap = false;
+
+	usart_rx_buf[wpos] = c;
+	usart_rx_buf_wpos = next_wpos;
+
+	unsigned int backlog = (next_wpos >= rpos) ? (next_wpos - rpos) :
+		(next_wpos + usart_rx_buf_len - rpos);
+
+	if (backlog > usart_rx_high_water) {
+		usart_rx_high_water = backlog;
+	}
+}
+
 static void usart_rxint()
 {
 	// Receive the character ASAP.
@@ -76,16 +145,41 @@ static void usart_rxint()
 	USART_SendData(OUR_USART, c);
 #endif
 
-	unsigned int wpos = usart_rx_buf_wpos;
-	unsigned int next_wpos = advance_pos(wpos, 1);
+	usart_rx_store(c);
 
-	if (next_wpos == usart_rx_buf_rpos) {
-		usart_rx_spilled++;
-		return;
+	void (*wake)(void) = usart_wake;
+
+	if (wake) {
+		usart_wake = NULL;
+		wake();
 	}
+}
 
-	usart_rx_buf[wpos] = c;
-	usart_rx_buf_wpos = next_wpos;
+// Puts data into the receive buffer as though it had been received.
+// For test generators; call it from an interrupt at the same priority
+// as the USART's, so the two can't interleave.
+void usart_inject(const char *data, unsigned int len)
+{
+	while (len--) {
+		usart_rx_store(*data++);
+	}
+}
+
+// Shortens a chunk at rpos so it doesn't run past the oldest unreported
+// overflow episode.
+static unsigned int clip_to_gap(unsigned int rpos, unsigned int bytes)
+{
+	unsigned int g = usart_gaps_rd;
+
+	if (g != usart_gaps_wr) {
+		unsigned int gap_pos = usart_gaps[g % NUM_GAPS].pos;
+
+		if ((gap_pos > rpos) && (gap_pos < rpos + bytes)) {
+			return gap_pos - rpos;
+		}
+	}
+
+	return bytes;
 }
 
 // RXNE is the interrupt flag
@@ -97,23 +191,41 @@ void usart_int_handler()
 	}
 }
 
+// Received data not yet released by usart_receive_chunk
+unsigned int usart_rx_backlog(void)
+{
+	unsigned int backlog = usart_rx_buf_wpos + usart_rx_buf_len -
+		usart_rx_buf_rpos;
+
+	if (backlog >= usart_rx_buf_len) {
+		backlog -= usart_rx_buf_len;
+	}
+
+	return backlog;
+}
+
 // Logic for return here is as follows:
-// 1) Always return in timeout time
+// 1) Always return in timeout_us time
 // 1a) can return early if the amount exceeds min_preferred_chunk
 // 1b) can also return early if we are at the end of the buffer
 // 2) If, after timeout, we have at least some we can return that keeps us
 // aligned with preferred_align, return it
-// 3) else, return everything we have
+// 3) else, return everything we have-- unless hold_partial is set, in
+// which case a less-than-preferred_align remainder is left in the buffer
+// (see usart_peek_partial)
+// 4) and never run past where received data was dropped (see
+// usart_take_gap)
 // It's expected the buffer is a multiple of preferred_align.
 // min_preferred_chunk should be >= 2x preferred_align; that way, if we
 // are unaligned we can get a complete aligned chunk plus the offset
-const char *usart_receive_chunk(unsigned int timeout,
+const char *usart_receive_chunk(uint32_t timeout_us,
 		unsigned int preferred_align,
 		unsigned int min_preferred_chunk,
 		unsigned int max_preferred_chunk,
+		bool hold_partial,
 		unsigned int *bytes_returned)
 {
-	unsigned int expiration = systick_cnt + timeout;
+	uint32_t deadline = timebase_deadline(timeout_us);
 
 	// Release the previously read chunk, so receiving can proceed into it
 	unsigned int rpos = usart_rx_buf_next_rpos;
@@ -135,7 +247,11 @@ const char *usart_receive_chunk(unsigned int timeout,
 		bytes = wpos - rpos;
 
 		if (bytes >= min_preferred_chunk) break;
-	} while (systick_cnt < expiration);
+
+		if (usart_idle) {
+			usart_idle();
+		}
+	} while (!timebase_expired(deadline));
 
 	if (bytes > max_preferred_chunk) {
 		bytes = max_preferred_chunk;
@@ -151,8 +267,12 @@ const char *usart_receive_chunk(unsigned int timeout,
 
 		// Unfixup for align
 		bytes -= unalign;
+	} else if (hold_partial) {
+		bytes = 0;
 	}
 
+	bytes = clip_to_gap(rpos, bytes);
+
 	*bytes_returned = bytes;
 
 	// Next time, we'll release these returned bytes.
@@ -161,14 +281,126 @@ const char *usart_receive_chunk(unsigned int timeout,
 	return (const char *) (usart_rx_buf + rpos);
 }
 
-void usart_init(uint32_t baud, void *rx_buf, unsigned int rx_buf_len)
+// Returns the data received but not yet handed out by
+// usart_receive_chunk, up to the end of the buffer, without consuming it.
+// It stays valid until the next usart_receive_chunk call.
+const char *usart_peek_partial(unsigned int *bytes_returned)
 {
-	usart_rx_buf = rx_buf;
-	usart_rx_buf_len = rx_buf_len;
+	unsigned int rpos = usart_rx_buf_next_rpos;
+	unsigned int wpos = usart_rx_buf_wpos;
 
-	// program GPIOs
-	usart_initpin(TXPORT, TXPIN);
-	usart_initpin(RXPORT, RXPIN);
+	if (wpos < rpos) {
+		*bytes_returned = usart_rx_buf_len - rpos;
+	} else {
+		*bytes_returned = wpos - rpos;
+	}
+
+	*bytes_returned = clip_to_gap(rpos, *bytes_returned);
+
+	return (const char *) (usart_rx_buf + rpos);
+}
+
+// Reports an overflow episode that comes right before the chunk last
+// returned by usart_receive_chunk, so the caller can mark the hole before
+// storing the chunk.  Episodes still in progress aren't reported yet; no
+// data can follow them.
+bool usart_take_gap(struct usart_gap *gap)
+{
+	unsigned int g = usart_gaps_rd;
+
+	if (g == usart_gaps_wr) {
+		return false;
+	}
+
+	if (usart_gaps[g % NUM_GAPS].pos != usart_rx_buf_rpos) {
+		return false;
+	}
+
+	// Check after the position, so a byte stored in between can't leave
+	// us reporting a short count.
+	if (usart_in_gap && (g + 1 == usart_gaps_wr)) {
+		return false;
+	}
+
+	gap->time = usart_gaps[g % NUM_GAPS].time;
+	gap->bytes = usart_gaps[g % NUM_GAPS].bytes;
+
+	usart_gaps_rd = g + 1;
+
+	return true;
+}
+
+// Total bytes dropped so far because the receive buffer was full.
+unsigned int usart_rx_spill_count(void)
+{
+	return usart_rx_spilled;
+}
+
+// The most received data that's ever been waiting in the buffer,
+// counting the chunk still being handled by the caller.
+unsigned int usart_rx_high_water_mark(void)
+{
+	return usart_rx_high_water;
+}
+
+// Where a position in data that had wrapped to the start ends up, after
+// growing moves the first extra bytes of it past the old end and the
+// rest down to the start.
+static inline unsigned int grown_pos(unsigned int pos, unsigned int rpos,
+		unsigned int old_len, unsigned int extra)
+{
+	if (pos >= rpos) {
+		return pos;
+	}
+
+	if (pos < extra) {
+		return old_len + pos;
+	}
+
+	return pos - extra;
+}
+
+// Lengthens the receive buffer in place, to new_len bytes from the same
+// start, keeping everything received so far.  Data that has wrapped to
+// the start is moved to follow on past the old end, as much as fits
+// there, and what doesn't is moved down to the start.
+void usart_grow_buffer(unsigned int new_len)
+{
+	NVIC_DisableIRQ(USART1_IRQn);
+
+	unsigned int old_len = usart_rx_buf_len;
+	unsigned int rpos = usart_rx_buf_rpos;
+	unsigned int wpos = usart_rx_buf_wpos;
+	unsigned int extra = new_len - old_len;
+
+	if (wpos < rpos) {
+		unsigned int up = (wpos < extra) ? wpos : extra;
+
+		memcpy((char *) usart_rx_buf + old_len,
+				(const char *) usart_rx_buf, up);
+		memmove((char *) usart_rx_buf,
+				(const char *) usart_rx_buf + up, wpos - up);
+
+		usart_rx_buf_wpos = grown_pos(wpos, rpos, old_len, extra);
+		usart_rx_buf_next_rpos = grown_pos(usart_rx_buf_next_rpos,
+				rpos, old_len, extra);
+
+		for (unsigned int g = usart_gaps_rd; g != usart_gaps_wr; g++) {
+			usart_gaps[g % NUM_GAPS].pos =
+				grown_pos(usart_gaps[g % NUM_GAPS].pos,
+						rpos, old_len, extra);
+		}
+	}
+
+	usart_rx_buf_len = new_len;
+
+	NVIC_EnableIRQ(USART1_IRQn);
+}
+
+// Changes the baud rate; anything partway through arriving is garbled.
+void usart_set_baud(uint32_t baud)
+{
+	usart_baud = baud;
 
 	// Fill out default parameters; stuff in our baudrate
 	USART_InitTypeDef usart_params;
@@ -176,11 +408,58 @@ void usart_init(uint32_t baud, void *rx_buf, unsigned int rx_buf_len)
 
 	usart_params.USART_BaudRate = baud;
 
-	// Init the USART
+	// Init the USART; it's only reprogrammed while disabled.
+	USART_Cmd(OUR_USART, DISABLE);
 	USART_Init(OUR_USART, &usart_params);
 
 	// Enable the USART
 	USART_Cmd(OUR_USART, ENABLE);
+}
+
+// For keeping the baud rate where it is while APB2's clock changes: the
+// divider for it with APB2 at pclk2_hz, worked out ahead so loading it
+// can follow the clock change immediately.  Only the divider's
+// rewritten, so reception carries on.  Assumes 16x oversampling, as
+// usart_set_baud leaves it.
+uint16_t usart_brr(uint32_t pclk2_hz)
+{
+	return (pclk2_hz + usart_baud / 2) / usart_baud;
+}
+
+void usart_load_brr(uint16_t brr)
+{
+	OUR_USART->BRR = brr;
+}
+
+// idle is called each time round usart_receive_chunk's wait; NULL to
+// just spin.
+void usart_set_idle(void (*idle)(void))
+{
+	usart_idle = idle;
+}
+
+// wake is called, once, from the interrupt for the next byte received.
+void usart_arm_wake(void (*wake)(void))
+{
+	usart_wake = wake;
+}
+
+// Stops receiving, for modes that take the whole buffer for themselves.
+void usart_stop(void)
+{
+	USART_ITConfig(OUR_USART, USART_IT_RXNE, DISABLE);
+}
+
+void usart_init(uint32_t baud, void *rx_buf, unsigned int rx_buf_len)
+{
+	usart_rx_buf = rx_buf;
+	usart_rx_buf_len = rx_buf_len;
+
+	// program GPIOs
+	usart_initpin(TXPORT, TXPIN);
+	usart_initpin(RXPORT, RXPIN);
+
+	usart_set_baud(baud);
 
 	//USART_SendData(OUR_USART, 'Z');
 
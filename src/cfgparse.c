@@ -0,0 +1,235 @@
+// Streaming config file parser
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <cfgparse.h>
+
+enum {
+	ST_START,	// Before the opening brace
+	ST_FIRST_KEY,	// A key, or the closing brace of an empty object
+	ST_NEXT_KEY,	// After a comma: must be a key
+	ST_KEY,
+	ST_COLON,
+	ST_VALUE,
+	ST_STRING,
+	ST_PRIMITIVE,
+	ST_NESTED,
+	ST_AFTER_VALUE,
+	ST_DONE,
+};
+
+static inline bool is_space(char c)
+{
+	return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+}
+
+static inline void put_char(char *buf, unsigned int *len, unsigned int max,
+		char c)
+{
+	if (*len < max) {
+		buf[*len] = c;
+	}
+
+	(*len)++;
+}
+
+static void emit(struct cfg_parser *p, enum cfg_val_type type)
+{
+	struct cfg_value val = {
+		.type = type,
+		.text = p->val,
+		.len = (p->val_len < CFG_VAL_MAX) ? p->val_len : CFG_VAL_MAX,
+		.key_pos = p->key_pos,
+	};
+
+	p->handler(p->key, p->key_len, &val);
+}
+
+void cfgparse_init(struct cfg_parser *p, cfg_handler_t handler)
+{
+	p->handler = handler;
+	p->pos = 0;
+	p->state = ST_START;
+}
+
+int cfgparse_feed(struct cfg_parser *p, const char *buf, unsigned int len)
+{
+	for (unsigned int i = 0; i < len; i++, p->pos++) {
+		char c = buf[i];
+
+		switch (p->state) {
+			case ST_START:
+				if (c == '{') {
+					p->state = ST_FIRST_KEY;
+				} else if (!is_space(c)) {
+					return -1;
+				}
+
+				break;
+
+			case ST_FIRST_KEY:
+				if (c == '}') {
+					p->state = ST_DONE;
+					break;
+				}
+
+				/* fall through */
+			case ST_NEXT_KEY:
+				if (c == '"') {
+					p->key_len = 0;
+					p->key_pos = p->pos + 1;
+					p->escape = false;
+					p->state = ST_KEY;
+				} else if (!is_space(c)) {
+					return -1;
+				}
+
+				break;
+
+			case ST_KEY:
+				if (!p->escape && (c == '"')) {
+					p->state = ST_COLON;
+					break;
+				}
+
+				p->escape = !p->escape && (c == '\\');
+
+				put_char(p->key, &p->key_len, CFG_KEY_MAX, c);
+
+				break;
+
+			case ST_COLON:
+				if (c == ':') {
+					p->state = ST_VALUE;
+				} else if (!is_space(c)) {
+					return -1;
+				}
+
+				break;
+
+			case ST_VALUE:
+				p->val_len = 0;
+				p->escape = false;
+
+				if (is_space(c)) {
+					break;
+				} else if (c == '"') {
+					p->state = ST_STRING;
+				} else if ((c == '{') || (c == '[')) {
+					p->depth = 1;
+					p->nested_str = false;
+					p->state = ST_NESTED;
+				} else if ((c == ',') || (c == ':') ||
+						(c == '}') || (c == ']')) {
+					return -1;
+				} else {
+					put_char(p->val, &p->val_len,
+							CFG_VAL_MAX, c);
+					p->state = ST_PRIMITIVE;
+				}
+
+				break;
+
+			case ST_STRING:
+				if (!p->escape && (c == '"')) {
+					emit(p, CFG_VAL_STRING);
+					p->state = ST_AFTER_VALUE;
+					break;
+				}
+
+				p->escape = !p->escape && (c == '\\');
+
+				put_char(p->val, &p->val_len, CFG_VAL_MAX, c);
+
+				break;
+
+			case ST_NESTED:
+				if (p->nested_str) {
+					if (!p->escape && (c == '"')) {
+						p->nested_str = false;
+					}
+
+					p->escape = !p->escape && (c == '\\');
+				} else if (c == '"') {
+					p->nested_str = true;
+				} else if ((c == '{') || (c == '[')) {
+					if (++p->depth == 0) {
+						return -1;
+					}
+				} else if ((c == '}') || (c == ']')) {
+					if (--p->depth == 0) {
+						emit(p, CFG_VAL_NESTED);
+						p->state = ST_AFTER_VALUE;
+					}
+				}
+
+				break;
+
+			case ST_PRIMITIVE:
+				if (!is_space(c) && (c != ',') && (c != '}')) {
+					put_char(p->val, &p->val_len,
+							CFG_VAL_MAX, c);
+					break;
+				}
+
+				// A number or word this long isn't one we know.
+				if (p->val_len > CFG_VAL_MAX) {
+					return -1;
+				}
+
+				emit(p, CFG_VAL_PRIMITIVE);
+				p->state = ST_AFTER_VALUE;
+
+				/* fall through; c ends the value too */
+			case ST_AFTER_VALUE:
+				if (c == ',') {
+					p->state = ST_NEXT_KEY;
+				} else if (c == '}') {
+					p->state = ST_DONE;
+				} else if (!is_space(c)) {
+					return -1;
+				}
+
+				break;
+
+			case ST_DONE:
+				if (!is_space(c)) {
+					return -1;
+				}
+
+				break;
+		}
+	}
+
+	return 0;
+}
+
+int cfgparse_finish(struct cfg_parser *p)
+{
+	if (p->state != ST_DONE) {
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,107 @@
+// Adaptive receive chunk sizing
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <chunktune.h>
+
+#define ALIGN 512
+
+// Gather at least this long's worth of input per write, and at least
+// this many times the recent worst write time.
+#define MIN_GATHER_MS 20
+#define GATHER_WRITES 2
+
+// Timeout limits
+#define MIN_TIMEOUT_US 20000
+#define MAX_TIMEOUT_US 600000
+
+static inline unsigned int clamp(unsigned int v, unsigned int lo,
+		unsigned int hi)
+{
+	if (v < lo) return lo;
+	if (v > hi) return hi;
+	return v;
+}
+
+static inline unsigned int align_down(unsigned int v)
+{
+	return v & ~(ALIGN - 1);
+}
+
+void chunk_tune_init(struct chunk_tune *t, unsigned int buf_len)
+{
+	t->buf_len = buf_len;
+	t->rate = 0;
+	t->write_us = 0;
+
+	// The long-standing fixed choice, until we know better: 200ms,
+	// >= 2560 byte chunks, and never more than 40K or about 2/5 of the
+	// buffer at once, because we want to finish the IO and free it up.
+	t->timeout_us = 200000;
+	t->min_chunk = 5 * ALIGN;
+	t->max_chunk = clamp(align_down(buf_len * 2 / 5), 8 * ALIGN, 40 * 1024);
+}
+
+// Call after each receive-and-store pass: bytes received, how long the
+// whole pass took, how long storing took, and how much was left waiting.
+void chunk_tune_update(struct chunk_tune *t, unsigned int bytes,
+		uint32_t elapsed_us, uint32_t write_us, unsigned int backlog)
+{
+	if (elapsed_us) {
+		uint32_t inst = (uint64_t) bytes * 1000000 / elapsed_us;
+
+		// Smooth over about 8 passes
+		t->rate = t->rate - t->rate / 8 + inst / 8;
+	}
+
+	// Track write stalls quickly, and forget them slowly.
+	if (write_us > t->write_us) {
+		t->write_us = write_us;
+	} else {
+		t->write_us -= (t->write_us - write_us) / 16;
+	}
+
+	uint32_t gather_ms = t->write_us * GATHER_WRITES / 1000;
+
+	if (gather_ms < MIN_GATHER_MS) {
+		gather_ms = MIN_GATHER_MS;
+	}
+
+	// Never ask for more than a quarter of the buffer before writing,
+	// and never let one write take more than 2/5 of it, so the buffer
+	// is freed in reasonable pieces.
+	unsigned int max_limit = align_down(t->buf_len * 2 / 5);
+
+	t->min_chunk = clamp(align_down((uint64_t) t->rate * gather_ms / 1000),
+			2 * ALIGN, align_down(t->buf_len / 4));
+
+	t->max_chunk = clamp(align_down(backlog > 4 * t->min_chunk ?
+				backlog : 4 * t->min_chunk),
+			8 * ALIGN, max_limit);
+
+	// Wait about as long as it should take min_chunk to arrive, with
+	// some slack, so at low rates partial chunks still go out promptly.
+	t->timeout_us = clamp(gather_ms * 3 / 2 * 1000,
+			MIN_TIMEOUT_US, MAX_TIMEOUT_US);
+}
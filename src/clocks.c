@@ -0,0 +1,314 @@
+// Clock profiles
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <string.h>
+
+#include <stm32f4xx_flash.h>
+#include <stm32f4xx_pwr.h>
+#include <stm32f4xx_rcc.h>
+
+#include <clocks.h>
+#include <timebase.h>
+#include <usart.h>
+
+// The USART's divider is the APB2 clock over the baud rate, to 1/16th
+// of 16: within half a percent is comfortably inside what a receiver
+// tolerates.
+#define CLOCK_BAUD_TOLERANCE_PPM 5000
+
+const struct clock_profile clock_profiles[] = {
+	// What this has always run: 96MHz, with SDIO underclocked to
+	// 38.4MHz (a 19.2MHz card clock).
+	[CLOCK_PROFILE_STANDARD] = { "standard", 96000000, 38400000 },
+	// The F411's rated 100MHz; SDIO gets 44.4MHz.
+	{ "maxCore", 100000000, 48000000 },
+	// SDIO at its rated 48MHz (a 24MHz card clock), core at 96MHz.
+	{ "maxCard", 96000000, 48000000 },
+	// Half speed, at the lowest voltage scale; for battery-powered
+	// logging at modest rates.  SDIO still gets 48MHz.
+	{ "lowPower", 48000000, 48000000 },
+};
+
+const unsigned int num_clock_profiles =
+	sizeof(clock_profiles) / sizeof(*clock_profiles);
+
+uint32_t clocks_core_hz;
+uint32_t clocks_sdio_hz;
+
+// The core clock as clocks_setup left it, before any divider
+static uint32_t clocks_full_hz;
+
+static bool hse_tried;
+static bool hse_ok;
+
+struct pll_plan {
+	uint16_t n, p, q;
+	uint32_t core_hz, sdio_hz;
+};
+
+int clocks_find_profile(const char *name, unsigned int len)
+{
+	for (unsigned int i = 0; i < num_clock_profiles; i++) {
+		if ((strlen(clock_profiles[i].name) == len) &&
+				!strncasecmp(clock_profiles[i].name, name, len)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static bool baud_ok(uint32_t pclk, uint32_t baud)
+{
+	if (!baud) {
+		return true;
+	}
+
+	uint32_t div = (pclk + baud / 2) / baud;
+	uint32_t actual = pclk / div;
+	uint32_t err = (actual > baud) ? actual - baud : baud - actual;
+
+	return (uint64_t) err * 1000000 / baud <= CLOCK_BAUD_TOLERANCE_PPM;
+}
+
+// The PLL's input is 2MHz from either oscillator; the VCO must be
+// 100-432MHz, P one of 2, 4, 6 or 8, and Q 2-15.
+static bool plan_pll(const struct clock_profile *prof, uint32_t baud,
+		struct pll_plan *best)
+{
+	best->core_hz = 0;
+
+	for (uint32_t n = 50; n <= 216; n++) {
+		uint32_t vco = 2000000 * n;
+
+		for (uint32_t p = 2; p <= 8; p += 2) {
+			uint32_t core = vco / p;
+			uint32_t q = (vco + prof->max_sdio_hz - 1) /
+				prof->max_sdio_hz;
+
+			if (q < 2) {
+				q = 2;
+			}
+
+			// Whole MHz only, for the timebase's prescaler.
+			if ((core > prof->max_core_hz) || (q > 15) ||
+					(core % 1000000) ||
+					!baud_ok(core, baud)) {
+				continue;
+			}
+
+			uint32_t sdio = vco / q;
+
+			// Fastest core, then fastest SDIO, then lowest VCO.
+			if ((core > best->core_hz) ||
+					((core == best->core_hz) &&
+					 (sdio > best->sdio_hz))) {
+				*best = (struct pll_plan) {
+					.n = n, .p = p, .q = q,
+					.core_hz = core, .sdio_hz = sdio
+				};
+			}
+		}
+	}
+
+	return best->core_hz != 0;
+}
+
+// Systick at 250Hz and the timebase at 1MHz, whatever the core's at.
+static void clocks_retime(void)
+{
+	SysTick_Config(clocks_core_hz / 250);
+
+	// TIM5's clocked at the core's rate; see clocks_setup
+	timebase_init(clocks_core_hz, clocks_core_hz);
+}
+
+// Switches to the profile, via HSI.  Peripherals keep running; systick
+// and the timebase are set up again, but the USART's baud rate must be
+// too (it's probably changing anyway).  Returns false if the external
+// oscillator didn't start, and HSI is in use instead.
+bool clocks_setup(unsigned int profile, uint32_t baud)
+{
+	struct pll_plan plan;
+
+	if ((profile >= num_clock_profiles) ||
+			!plan_pll(&clock_profiles[profile], baud, &plan)) {
+		// Nothing fits the baud rate: give up on that, rather than
+		// not run.
+		if (profile >= num_clock_profiles) {
+			profile = CLOCK_PROFILE_STANDARD;
+		}
+
+		plan_pll(&clock_profiles[profile], 0, &plan);
+	}
+
+	// Run from HSI while the PLL's changed.
+	RCC_HSICmd(ENABLE);
+
+	while (RCC_GetFlagStatus(RCC_FLAG_HSIRDY) == RESET);
+
+	RCC_SYSCLKConfig(RCC_SYSCLKSource_HSI);
+
+	while (RCC_GetSYSCLKSource() != 0x00);
+
+	RCC_PLLCmd(DISABLE);
+
+	if (!hse_tried) {
+		RCC_HSEConfig(RCC_HSE_ON);
+
+		hse_ok = RCC_WaitForHSEStartUp() == SUCCESS;
+		hse_tried = true;
+	}
+
+	if (hse_ok) {
+		RCC_PLLConfig(RCC_PLLSource_HSE, HSE_VALUE / 2000000,
+				plan.n, plan.p, plan.q);
+	} else {
+		RCC_PLLConfig(RCC_PLLSource_HSI, HSI_VALUE / 2000000,
+				plan.n, plan.p, plan.q);
+	}
+
+	// Can only be changed with the PLL off.  Scale 1 is good to
+	// 100MHz, 2 to 84MHz and 3 to 64MHz.
+	RCC_APB1PeriphClockCmd(RCC_APB1Periph_PWR, ENABLE);
+
+	if (plan.core_hz > 84000000) {
+		PWR_MainRegulatorModeConfig(PWR_Regulator_Voltage_Scale1);
+	} else if (plan.core_hz > 64000000) {
+		PWR_MainRegulatorModeConfig(PWR_Regulator_Voltage_Scale2);
+	} else {
+		PWR_MainRegulatorModeConfig(PWR_Regulator_Voltage_Scale3);
+	}
+
+	RCC_PLLCmd(ENABLE);
+
+	// A wait state per 30MHz at >2.7V.  Set now, while on HSI any
+	// number of them is fine.  The caches can only be reset while
+	// off.
+	FLASH_SetLatency((plan.core_hz - 1) / 30000000);
+
+	FLASH_InstructionCacheCmd(DISABLE);
+	FLASH_DataCacheCmd(DISABLE);
+	FLASH_InstructionCacheReset();
+	FLASH_DataCacheReset();
+	FLASH_InstructionCacheCmd(ENABLE);
+	FLASH_DataCacheCmd(ENABLE);
+	FLASH_PrefetchBufferCmd(ENABLE);
+
+	// AHB at the core clock, APB2 (USART, SDIO) too; APB1 at most
+	// 50MHz.  Timers on APB1 get double when it's divided, so all the
+	// timers run at the core clock.
+	RCC_HCLKConfig(RCC_SYSCLK_Div1);
+	RCC_PCLK1Config((plan.core_hz > 50000000) ?
+			RCC_HCLK_Div2 : RCC_HCLK_Div1);
+	RCC_PCLK2Config(RCC_HCLK_Div1);
+	RCC_TIMCLKPresConfig(RCC_TIMPrescDesactivated);
+
+	while (RCC_GetFlagStatus(RCC_FLAG_PLLRDY) == RESET);
+	while (PWR_GetFlagStatus(PWR_FLAG_VOSRDY) == RESET);
+
+	RCC_SYSCLKConfig(RCC_SYSCLKSource_PLLCLK);
+
+	while (RCC_GetSYSCLKSource() != 0x08);
+
+	clocks_core_hz = clocks_full_hz = plan.core_hz;
+	clocks_sdio_hz = plan.sdio_hz;
+
+	clocks_retime();
+
+	return hse_ok;
+}
+
+// The largest divider clocks_set_divider can use and still receive at
+// baud: the USART needs 16 APB2 clocks a bit, and the divider within
+// tolerance, and SDIO needs APB2 at least 3/8 of its own clock.  The
+// result must be whole MHz too, for the timebase's prescaler.
+unsigned int clocks_max_divider(uint32_t baud)
+{
+	unsigned int best = 1;
+
+	for (unsigned int div = 2; div <= 8; div *= 2) {
+		uint32_t hclk = clocks_full_hz / div;
+
+		if ((hclk % 1000000) ||
+				(hclk < 16 * baud) || !baud_ok(hclk, baud) ||
+				((uint64_t) hclk * 8 <
+				 (uint64_t) clocks_sdio_hz * 3)) {
+			break;
+		}
+
+		best = div;
+	}
+
+	return best;
+}
+
+// Divides the core and bus clocks (1, 2, 4 or 8) down from what
+// clocks_setup chose, or back up.  Only the AHB prescaler changes, so
+// it's immediate, with the PLL, SDIO's clock and the flash setup left
+// alone; systick, the timebase and the USART's baud are kept where they
+// were.  Interrupts are held off throughout, so nothing sees them half
+// changed.
+void clocks_set_divider(unsigned int div)
+{
+	uint32_t hpre;
+
+	switch (div) {
+		case 2:
+			hpre = RCC_SYSCLK_Div2;
+			break;
+		case 4:
+			hpre = RCC_SYSCLK_Div4;
+			break;
+		case 8:
+			hpre = RCC_SYSCLK_Div8;
+			break;
+		default:
+			div = 1;
+			hpre = RCC_SYSCLK_Div1;
+			break;
+	}
+
+	uint32_t hz = clocks_full_hz / div;
+
+	// Everything worked out first.  The USART's sampling is off from
+	// the prescaler changing until its divider follows, so those two
+	// go back to back: a byte arriving as a burst starts (which is
+	// what wakes us) mustn't be garbled.
+	uint32_t cfgr = (RCC->CFGR & ~RCC_CFGR_HPRE) | hpre;
+	uint16_t brr = usart_brr(hz);
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+
+	RCC->CFGR = cfgr;
+	usart_load_brr(brr);
+
+	clocks_core_hz = hz;
+
+	clocks_retime();
+
+	__set_PRIMASK(primask);
+}
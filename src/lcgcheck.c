@@ -0,0 +1,169 @@
+// Streaming checker for the LCG test pattern
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <string.h>
+
+#include <lcgcheck.h>
+
+// Number of steps from state from to state to.  For a full-period LCG
+// this can be solved a bit at a time (as in O'Neill's PCG), instead of
+// by stepping through up to 2^32 states.
+static uint32_t lcg_distance(uint32_t from, uint32_t to)
+{
+	uint32_t mult = 1664525, plus = 1013904223;
+	uint32_t bit = 1, dist = 0;
+
+	while (from != to) {
+		if ((from & bit) != (to & bit)) {
+			from = from * mult + plus;
+			dist |= bit;
+		}
+
+		bit <<= 1;
+		plus = (mult + 1) * plus;
+		mult *= mult;
+	}
+
+	return dist;
+}
+
+static inline uint32_t get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+void lcg_check_init(struct lcg_check *chk)
+{
+	memset(chk, 0, sizeof(*chk));
+
+	chk->cur = lcg_next(0);
+	chk->synced = true;
+	chk->first_err = LCG_CHECK_NO_ERR;
+}
+
+// Slides the resync window along; once it holds a word followed by its
+// successor, we know where we are in the pattern again.
+static void resync(struct lcg_check *chk, uint8_t c)
+{
+	chk->since_err++;
+
+	if (chk->win_len == sizeof(chk->win)) {
+		memmove(chk->win, chk->win + 1, sizeof(chk->win) - 1);
+		chk->win_len--;
+	}
+
+	chk->win[chk->win_len++] = c;
+
+	if (chk->win_len < sizeof(chk->win)) {
+		return;
+	}
+
+	uint32_t word = get32(chk->win);
+
+	if (get32(chk->win + 4) != lcg_next(word)) {
+		return;
+	}
+
+	// Where the window starts, in the pattern and in what we received,
+	// relative to the point where things went wrong.
+	uint64_t cur_start = chk->err_ideal - chk->byte_idx;
+	int32_t steps = (int32_t) lcg_distance(chk->cur, word);
+	uint64_t ideal_gap = cur_start + 4 * (int64_t) steps - chk->err_ideal;
+	uint64_t rx_gap = chk->since_err - sizeof(chk->win);
+
+	if ((int64_t) ideal_gap >= (int64_t) rx_gap) {
+		chk->dropped += ideal_gap - rx_gap;
+	} else {
+		chk->duplicated += rx_gap - ideal_gap;
+	}
+
+	chk->ideal = chk->err_ideal + ideal_gap + sizeof(chk->win);
+	chk->good += sizeof(chk->win);
+	chk->cur = lcg_next(lcg_next(word));
+	chk->byte_idx = 0;
+	chk->synced = true;
+}
+
+void lcg_check_feed(struct lcg_check *chk, const uint8_t *data,
+		unsigned int len, uint32_t now_ms)
+{
+	if (!len) {
+		return;
+	}
+
+	if (!chk->received) {
+		chk->first_ms = now_ms;
+	}
+
+	chk->last_ms = now_ms;
+
+	for (unsigned int i = 0; i < len; i++) {
+		uint8_t c = data[i];
+
+		chk->received++;
+
+		if (!chk->synced) {
+			resync(chk, c);
+			continue;
+		}
+
+		if (c == ((chk->cur >> (8 * chk->byte_idx)) & 0xff)) {
+			chk->good++;
+			chk->ideal++;
+
+			if (++chk->byte_idx == 4) {
+				chk->cur = lcg_next(chk->cur);
+				chk->byte_idx = 0;
+			}
+
+			continue;
+		}
+
+		if (chk->first_err == LCG_CHECK_NO_ERR) {
+			chk->first_err = chk->received - 1;
+		}
+
+		chk->errors++;
+		chk->synced = false;
+		chk->win_len = 0;
+		chk->err_ideal = chk->ideal;
+		chk->since_err = 0;
+
+		resync(chk, c);
+	}
+}
+
+// Sustained rate of good data in bytes per second, between the first
+// and last data fed in.
+uint32_t lcg_check_rate(const struct lcg_check *chk)
+{
+	uint32_t ms = chk->last_ms - chk->first_ms;
+
+	if (!ms) {
+		return 0;
+	}
+
+	return chk->good * 1000 / ms;
+}
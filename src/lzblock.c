@@ -0,0 +1,144 @@
+// Fast LZ block compressor (LZ4 block format)
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <string.h>
+
+#include <lzblock.h>
+
+// Per the LZ4 block format: the last match must start at least 12 bytes
+// before the end of the block, and the last 5 bytes are always literals.
+#define MFLIMIT 12
+#define LASTLITERALS 5
+
+#define MINMATCH 4
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return v;
+}
+
+static inline unsigned int hash32(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// Emit a length that didn't fit in its token nibble.
+static inline uint8_t *put_len(uint8_t *op, unsigned int len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+
+	*op++ = len;
+
+	return op;
+}
+
+static uint8_t *put_literals(uint8_t *op, uint8_t *token,
+		const uint8_t *lit, unsigned int len)
+{
+	if (len >= 15) {
+		*token = 15 << 4;
+		op = put_len(op, len - 15);
+	} else {
+		*token = len << 4;
+	}
+
+	memcpy(op, lit, len);
+
+	return op + len;
+}
+
+// Compresses len (<= LZBLOCK_MAX_RAW) bytes from src into dst, which must
+// have room for LZBLOCK_BOUND(len).  table is scratch space for
+// 1 << LZ_HASH_BITS entries.  Returns the compressed size.
+//
+// This is a greedy single-probe match finder; it gives up some ratio
+// compared to LZ4 proper, but takes only a few cycles per byte.
+unsigned int lz_compress(const uint8_t *src, unsigned int len,
+		uint8_t *dst, uint16_t *table)
+{
+	uint8_t *op = dst;
+	unsigned int anchor = 0;
+
+	if (len > MFLIMIT) {
+		unsigned int mflimit = len - MFLIMIT;
+		unsigned int matchlimit = len - LASTLITERALS;
+		unsigned int ip = 0;
+
+		memset(table, 0, sizeof(*table) << LZ_HASH_BITS);
+
+		while (ip < mflimit) {
+			uint32_t v = read32(src + ip);
+			unsigned int h = hash32(v);
+			unsigned int ref = table[h];
+
+			table[h] = ip;
+
+			if ((ref >= ip) || (read32(src + ref) != v)) {
+				// Skip ahead faster through data that isn't
+				// matching.
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			unsigned int mlen = MINMATCH;
+
+			while ((ip + mlen < matchlimit) &&
+					(src[ref + mlen] == src[ip + mlen])) {
+				mlen++;
+			}
+
+			uint8_t *token = op++;
+
+			op = put_literals(op, token, src + anchor, ip - anchor);
+
+			*op++ = (ip - ref) & 0xff;
+			*op++ = (ip - ref) >> 8;
+
+			if (mlen - MINMATCH >= 15) {
+				*token |= 15;
+				op = put_len(op, mlen - MINMATCH - 15);
+			} else {
+				*token |= mlen - MINMATCH;
+			}
+
+			ip += mlen;
+			anchor = ip;
+		}
+	}
+
+	// Whatever's left goes out as literals.
+	uint8_t *token = op++;
+
+	op = put_literals(op, token, src + anchor, len - anchor);
+
+	return op - dst;
+}
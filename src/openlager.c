@@ -28,15 +28,31 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <bootstate.h>
+#include <diskio.h>
+#include <disktrace.h>
 #include <ff.h>
+#include <handoff.h>
 #include <led.h>
+#include <cfgparse.h>
+#include <chunktune.h>
+#include <clocks.h>
+#include <lcgcheck.h>
+#include <logframe.h>
+#include <lzblock.h>
+#include <power.h>
 #include <sdio.h>
 #include <usart.h>
 
+#include <misc.h>
+#include <stm32f4xx_crc.h>
+#include <stm32f4xx_iwdg.h>
+#include <stm32f4xx_pwr.h>
 #include <stm32f4xx_rcc.h>
+#include <stm32f4xx_rtc.h>
+#include <stm32f4xx_tim.h>
 #include <systick_handler.h>
-
-#include <jsmn.h>
+#include <timebase.h>
 
 #include <lagercfg.h>
 
@@ -47,35 +63,102 @@
 	 _a < _b ? _a : _b; })
 #endif
 
+#ifndef MAX
+#define MAX(a,b) \
+	({ __typeof__ (a) _a = (a); \
+	 __typeof__ (b) _b = (b); \
+	 _a > _b ? _a : _b; })
+#endif
+
+static void soak_tick(void) __attribute__((interrupt));
+
 const void *_interrupt_vectors[FPU_IRQn] __attribute((section(".interrupt_vectors"))) = {
+	[TIM4_IRQn] = soak_tick,
 	[USART1_IRQn] = usart_int_handler
 };
 
 static FATFS fatfs;
 
+// The receive buffer; most of RAM.  Must stay a multiple of 512 for
+// sector-aligned chunks.  What it leaves is ~5.5K for other statics
+// (FATFS, the FILs kept open, tail stash, ring header, report text) and
+// the stack, which the linker script keeps at least 6K for.  By the
+// -fstack-usage figures (make STACK_USAGE=1), the deepest stack use is
+// about 3.2K: logging's trace save creating a file, down through FatFs
+// into the SDIO driver, plus the USART interrupt's handler and its
+// 32 byte exception frame on top (the FPU is left off, so no FP state
+// is stacked).
+//
+// Capture starts at boot in its first RX_EARLY_LEN bytes, and the rest is
+// scratch space for config handling and the free-extent index until
+// logging starts.  Logging then grows the capture into everything but
+// its working space (40K at most), so RX_EARLY_LEN is as big as that
+// allows.  It holds about 0.8s of setup at 921600 baud, 0.37s at 2M;
+// card init, mount and a cached config normally fit well inside that,
+// and anything that doesn't is marked as a gap in the log.  BIST and
+// bench don't log, so they stop capture and take the whole area.
+static char rx_area[114*1024] __attribute__((aligned(4)));
+
+#define RX_EARLY_LEN (74*1024)
+#define RX_SCRATCH_LEN (sizeof(rx_area) - RX_EARLY_LEN)
+
+static char * const rx_scratch = rx_area + RX_EARLY_LEN;
+
 static uint32_t cfg_baudrate = 115200;
 static uint32_t cfg_prealloc = 0;
 static bool cfg_prealloc_grow = false;
+static bool cfg_prealloc_chain = false;
+static uint32_t cfg_sync_interval = 0;
+static bool cfg_stage_tail = false;
+static uint32_t cfg_ring_bytes = 0;
+static bool cfg_framed = false;
+static bool cfg_compress = false;
+static bool cfg_verify_lcg = false;
+static uint32_t cfg_logs_per_dir = 0;
 static bool cfg_bist = false;
+static bool cfg_bench = false;
+static uint32_t cfg_soak_rate = 0;
+static uint32_t cfg_soak_peak = 0;
+static uint32_t cfg_soak_seconds = 0;
+static bool cfg_write_stats = false;
+static bool cfg_auto_tune = false;
+static bool cfg_trace_disk = false;
+static bool cfg_led_fill = false;
+static unsigned int cfg_clock_profile = CLOCK_PROFILE_STANDARD;
+static uint32_t cfg_idle_clock_ms = 0;
 static bool osc_err = false;
 
 
 #define CFGFILE_NAME "lager.cfg"
+#define CFGCACHE_NAME "cfgcache.bin"
+#define TAILFILE_NAME "tail.bin"
+#define CHAINFILE_NAME "chain.bin"
+#define RINGFILE_NAME "ring.bin"
+#define VERIFYFILE_NAME "verify.txt"
+#define BENCHFILE_NAME "bench.bin"
+#define BENCHCSV_NAME "bench.csv"
+#define SOAKFILE_NAME "soak.txt"
+#define STATSFILE_NAME "stats.txt"
+#define TRACEFILE_NAME "trace.bin"
 
 // Must have non-digit characters before the digit characters.
 #define LOGNAME_FMT "log000.txt"
+#define LOGDIR_FMT "logs000"
+
+// Path of the log currently being written, relative to the root.
+static char log_path[] = LOGDIR_FMT "/" LOGNAME_FMT;
 
 #define NELEMENTS(x) (sizeof(x) / sizeof(*(x)))
 
 /* Configuration functions */
-static int parse_num(const char *cfg_buf, jsmntok_t *t) {
+static int parse_num(const struct cfg_value *val) {
 	int value = 0;
 	bool neg = false;
 
-	for (int pos = t->start; pos < t->end; pos++) {
-		char c = cfg_buf[pos];
+	for (unsigned int pos = 0; pos < val->len; pos++) {
+		char c = val->text[pos];
 
-		if ((c == '-') && (pos == t->start)) {
+		if ((c == '-') && (pos == 0)) {
 			neg = true;
 			continue;
 		}
@@ -96,8 +179,8 @@ static int parse_num(const char *cfg_buf, jsmntok_t *t) {
 	return value;
 }
 
-static bool parse_bool(const char *cfg_buf, jsmntok_t *t) {
-	switch (cfg_buf[t->start]) {
+static bool parse_bool(const struct cfg_value *val) {
+	switch (val->text[0]) {
 		case 't':
 		case 'T':
 			return true;
@@ -111,38 +194,134 @@ static bool parse_bool(const char *cfg_buf, jsmntok_t *t) {
 	return false;	// Unreachable
 }
 
-static inline bool compare_key(const char *cfg_buf, jsmntok_t *t,
-		const char *value, jsmntype_t typ) {
-	if ((t->end - t->start) != strlen(value)) {
-		return false;
+// One config key: the type its value must be, and what to do with it.
+// Whatever a handler sets lives in value, and the size bytes there are
+// what the binary cache keeps (0 for keys that only trigger something).
+struct cfg_key {
+	const char *name;
+	enum cfg_val_type type;
+	void (*handler)(const struct cfg_key *key,
+			const struct cfg_value *val);
+	void *value;
+	uint16_t size;
+};
+
+static void cfg_set_num(const struct cfg_key *key,
+		const struct cfg_value *val) {
+	*(uint32_t *) key->value = parse_num(val);
+}
+
+static void cfg_set_bool(const struct cfg_key *key,
+		const struct cfg_value *val) {
+	*(bool *) key->value = parse_bool(val);
+}
+
+static void cfg_set_text(const struct cfg_key *key,
+		const struct cfg_value *val) {
+	int len = MIN(val->len, key->size - 1);
+
+	memcpy(key->value, val->text, len);
+	((char *) key->value)[len] = 0;
+}
+
+static void cfg_set_profile(const struct cfg_key *key,
+		const struct cfg_value *val) {
+	int prof = clocks_find_profile(val->text, val->len);
+
+	if (prof < 0) {
+		led_panic("?CLK?");
 	}
 
-	// Technically we should be case sensitive, but.. Meh!
-	if (strncasecmp(value, cfg_buf + t->start,
-				t->end - t->start)) {
-		return false;
+	*(unsigned int *) key->value = prof;
+}
+
+static void cfg_use_spi(const struct cfg_key *key,
+		const struct cfg_value *val) {
+	if (parse_bool(val)) {
+		// XXX SPI not supported yet
+		led_panic("?SPI?");
 	}
+}
 
-	// OK, the key matches.  Is the value of the expected type? 
-	// if not, panic (invalid config)
-	if (typ != t[1].type) {
-		led_panic("?");
+// Remembers where the key is, to rename it once the card's formatted.
+static void cfg_format_card(const struct cfg_key *key,
+		const struct cfg_value *val) {
+	if (parse_bool(val)) {
+		*(int *) key->value = val->key_pos;
 	}
+}
 
-	return true;
+static char cfg_morse[128];
+static int cfg_format_key = -1;
+
+#define CFG_NUM(name, var) \
+	{ name, CFG_VAL_PRIMITIVE, cfg_set_num, &(var), sizeof(var) }
+#define CFG_BOOL(name, var) \
+	{ name, CFG_VAL_PRIMITIVE, cfg_set_bool, &(var), sizeof(var) }
+
+static const struct cfg_key cfg_keys[] = {
+	{ "startupMorse", CFG_VAL_STRING, cfg_set_text,
+		cfg_morse, sizeof(cfg_morse) },
+	{ "useSPI", CFG_VAL_PRIMITIVE, cfg_use_spi, NULL, 0 },
+	CFG_NUM("baudRate", cfg_baudrate),
+	CFG_NUM("preallocBytes", cfg_prealloc),
+	CFG_BOOL("preallocGrow", cfg_prealloc_grow),
+	CFG_BOOL("preallocChain", cfg_prealloc_chain),
+	CFG_NUM("syncInterval", cfg_sync_interval),
+	CFG_BOOL("stageTail", cfg_stage_tail),
+	CFG_NUM("ringBytes", cfg_ring_bytes),
+	CFG_BOOL("framed", cfg_framed),
+	CFG_BOOL("compress", cfg_compress),
+	CFG_BOOL("verifyLcg", cfg_verify_lcg),
+	CFG_NUM("logsPerDir", cfg_logs_per_dir),
+	{ "formatCard", CFG_VAL_PRIMITIVE, cfg_format_card,
+		&cfg_format_key, 0 },
+	CFG_BOOL("builtInSelfTest", cfg_bist),
+	CFG_BOOL("benchmark", cfg_bench),
+	CFG_NUM("soakRate", cfg_soak_rate),
+	CFG_NUM("soakPeak", cfg_soak_peak),
+	CFG_NUM("soakSeconds", cfg_soak_seconds),
+	CFG_BOOL("writeStats", cfg_write_stats),
+	CFG_BOOL("autoTune", cfg_auto_tune),
+	CFG_BOOL("traceDisk", cfg_trace_disk),
+	CFG_BOOL("ledFill", cfg_led_fill),
+	CFG_NUM("idleClockMs", cfg_idle_clock_ms),
+	{ "clockProfile", CFG_VAL_STRING, cfg_set_profile,
+		&cfg_clock_profile, sizeof(cfg_clock_profile) },
+};
+
+static void handle_config_key(const char *name, unsigned int len,
+		const struct cfg_value *val) {
+	for (int i = 0; i < NELEMENTS(cfg_keys); i++) {
+		const struct cfg_key *key = cfg_keys + i;
+
+		// Technically we should be case sensitive, but.. Meh!
+		if ((len != strlen(key->name)) ||
+				strncasecmp(key->name, name, len)) {
+			continue;
+		}
+
+		// OK, the key matches.  Is the value of the expected type? 
+		// if not, panic (invalid config)
+		if (val->type != key->type) {
+			led_panic("?");
+		}
+
+		key->handler(key, val);
+
+		return;
+	}
 }
 
-// Try to load a config file.  If it doesn't exist, create it.
-// If we can't load after that, PANNNNIC.
-void process_config() {
+// Creates the config file with the given contents, if it doesn't exist.
+static void write_config(const void *cfg, UINT wr_len) {
 	FIL cfg_file;
 
 	FRESULT res = f_open(&cfg_file, CFGFILE_NAME, FA_WRITE | FA_CREATE_NEW);
 
 	if (res == FR_OK) {
-		UINT wr_len = sizeof(lager_cfg);
 		UINT written;
-		res = f_write(&cfg_file, lager_cfg, wr_len, &written);
+		res = f_write(&cfg_file, cfg, wr_len, &written);
 
 		if (res != FR_OK) {
 			led_panic("WCFG");
@@ -156,99 +335,318 @@ void process_config() {
 	} else if (res != FR_EXIST) {
 		led_panic("WCFG2");
 	}
+}
+
+// Reformat the card with clusters as big as its allocation unit allows
+// (FatFs tops out at 64K) and the data area aligned to the AU, so
+// contiguous allocation is cheap and our cluster-sized writes never
+// straddle erase blocks.  Then put the config back, with formatCard
+// renamed to formatDone (same length) so it only happens once.
+static void format_card(char *cfg_buf, UINT len, int key_pos) {
+	uint32_t au = 0;
+	UINT cluster = 32768;
+
+	if (!sd_get_au_sectors(&au) && au) {
+		cluster = MIN(au, 128) * 512;
+	}
 
-	res = f_open(&cfg_file, CFGFILE_NAME, FA_READ | FA_OPEN_EXISTING);
+	FRESULT res;
+
+	// Big clusters can leave too few of them for the FAT type f_mkfs
+	// picked; step down until it fits.
+	do {
+		res = f_mkfs("0:", 0, cluster);
+		cluster /= 2;
+	} while ((res == FR_MKFS_ABORTED) && (cluster >= 512));
 
 	if (res != FR_OK) {
-		led_panic("RCFG");
+		// ..-. -- -
+		led_panic("FMT");
+	}
+
+	if (f_mount(&fatfs, "0:", 1) != FR_OK) {
+		// -.. .- - .-
+		led_panic("DATA ");
+	}
+
+	memcpy(cfg_buf + key_pos, "formatDone", 10);
+
+	write_config(cfg_buf, len);
+}
+
+// The configured baud rate and clock profile are kept in RTC backup
+// registers, which hold them across resets (and power-off, while VBAT is
+// kept up), so the next boot can start capturing at that rate before
+// reading the config.  Each is a value in one register and its
+// complement in the next.
+static uint32_t recall_backup(uint32_t reg, uint32_t dflt) {
+	uint32_t val = RTC_ReadBackupRegister(reg);
+
+	if (RTC_ReadBackupRegister(reg + 1) == ~val) {
+		return val;
+	}
+
+	return dflt;
+}
+
+// Whether it stuck.
+static bool remember_backup(uint32_t reg, uint32_t val) {
+	PWR_BackupAccessCmd(ENABLE);
+
+	RTC_WriteBackupRegister(reg, val);
+	RTC_WriteBackupRegister(reg + 1, ~val);
+
+	PWR_BackupAccessCmd(DISABLE);
+
+	return (RTC_ReadBackupRegister(reg) == val) &&
+		(RTC_ReadBackupRegister(reg + 1) == ~val);
+}
+
+// Booted on trial after an update, and the card and config are up:
+// tell the loader this slot's good, so it's the one run from now on,
+// and keep its watchdog from going off.  The loader left room in the
+// boot state log, so this is a couple of words programmed, not an erase.
+static void confirm_boot(uint8_t slot) {
+	struct boot_state state;
+
+	bootstate_load(&state);
+
+	if ((slot < NUM_SLOTS) && (state.trial == slot)) {
+		bootstate_append(&state, BOOTREC_CONFIRM, slot);
+	}
+
+	IWDG_ReloadCounter();
+	systick_feed_watchdog = true;
+}
+
+// Parsing the config is skipped when what it gave last time is still in
+// CFGCACHE_NAME.  That's good as long as lager.cfg has the same size and
+// modification time, and the keys, their sizes and their defaults haven't
+// changed (the schema hash) in this firmware.
+#define CFGCACHE_MAGIC 0x4843464f	/* "OFCH" */
+
+struct cfg_cache {
+	uint32_t magic;
+	uint32_t schema;
+	uint32_t cfg_size;
+	uint16_t cfg_date;
+	uint16_t cfg_time;
+	uint32_t len;		// Bytes of values following
+	uint32_t hash;		// ... and their hash
+};
+
+// FNV-1a
+#define CFG_HASH_INIT 2166136261U
+
+static uint32_t cfg_hash(uint32_t hash, const void *data, unsigned int len) {
+	const uint8_t *p = data;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+// Has to be worked out before the config's loaded, while the values are
+// still the defaults.
+static uint32_t cfg_schema(void) {
+	uint32_t hash = CFG_HASH_INIT;
+
+	for (int i = 0; i < NELEMENTS(cfg_keys); i++) {
+		const struct cfg_key *key = cfg_keys + i;
+
+		hash = cfg_hash(hash, key->name, strlen(key->name) + 1);
+		hash = cfg_hash(hash, &key->type, sizeof(key->type));
+		hash = cfg_hash(hash, &key->size, sizeof(key->size));
+		hash = cfg_hash(hash, key->value, key->size);
 	}
 
-	char cfg_buf[4096];
+	return hash;
+}
+
+// Copies the cached values between the config and buf, which must have
+// room for them all.  Returns how many bytes that is.
+static unsigned int cfg_cache_copy(uint8_t *buf, bool load) {
+	unsigned int len = 0;
+
+	for (int i = 0; i < NELEMENTS(cfg_keys); i++) {
+		const struct cfg_key *key = cfg_keys + i;
+
+		if (load) {
+			memcpy(key->value, buf + len, key->size);
+		} else {
+			memcpy(buf + len, key->value, key->size);
+		}
+
+		len += key->size;
+	}
 
-	char cfg_morse[128];
-	cfg_morse[0] = 0;
+	return len;
+}
+
+static bool load_config_cache(const FILINFO *info, uint32_t schema) {
+	FIL cache_file;
+
+	if (f_open(&cache_file, CFGCACHE_NAME,
+				FA_READ | FA_OPEN_EXISTING) != FR_OK) {
+		return false;
+	}
 
+	struct cfg_cache hdr;
+	uint8_t *buf = (uint8_t *) rx_scratch;
 	UINT amount;
 
-        if (FR_OK != f_read(&cfg_file, cfg_buf, sizeof(cfg_buf), &amount)) {
-		led_panic("RCFG");
+	bool ok = (f_read(&cache_file, &hdr, sizeof(hdr), &amount) == FR_OK) &&
+		(amount == sizeof(hdr)) &&
+		(hdr.magic == CFGCACHE_MAGIC) &&
+		(hdr.schema == schema) &&
+		(hdr.cfg_size == info->fsize) &&
+		(hdr.cfg_date == info->fdate) &&
+		(hdr.cfg_time == info->ftime) &&
+		(hdr.len <= RX_SCRATCH_LEN) &&
+		(f_read(&cache_file, buf, hdr.len, &amount) == FR_OK) &&
+		(amount == hdr.len) &&
+		(hdr.hash == cfg_hash(CFG_HASH_INIT, buf, hdr.len));
+
+	f_close(&cache_file);
+
+	// Copied only once it's all checked, so a bad cache changes nothing.
+	if (ok) {
+		ok = (cfg_cache_copy(buf, true) == hdr.len);
 	}
 
-	if (amount == 0 || amount >= sizeof(cfg_buf)) {
-		led_panic("RCFG");
+	return ok;
+}
+
+// Failing to write the cache just means parsing again next time.
+static void save_config_cache(uint32_t schema) {
+	FILINFO info;
+
+	// After formatting, lager.cfg was written again.
+	if (f_stat(CFGFILE_NAME, &info) != FR_OK) {
+		return;
 	}
 
-	jsmntok_t tokens[100];
-	jsmn_parser parser;
+	uint8_t *buf = (uint8_t *) rx_scratch;
 
-	jsmn_init(&parser);
+	struct cfg_cache hdr = {
+		.magic = CFGCACHE_MAGIC,
+		.schema = schema,
+		.cfg_size = info.fsize,
+		.cfg_date = info.fdate,
+		.cfg_time = info.ftime,
+		.len = cfg_cache_copy(buf, false),
+	};
 
-	/* parse config */
-	int num_tokens = jsmn_parse(&parser, cfg_buf, amount, tokens, 100);
+	hdr.hash = cfg_hash(CFG_HASH_INIT, buf, hdr.len);
 
-	// Minimal should be JSMN_OBJECT 
-	if (num_tokens < 1) {
-		// ..--..
-		led_panic("?");
+	FIL cache_file;
+
+	if (f_open(&cache_file, CFGCACHE_NAME,
+				FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
+		return;
 	}
 
-	int skip_count = 0;
+	UINT written;
 
-	if (tokens[0].type != JSMN_OBJECT) {
-		// ..--..
-		led_panic("?");
+	f_write(&cache_file, &hdr, sizeof(hdr), &written);
+	f_write(&cache_file, buf, hdr.len, &written);
+
+	f_close(&cache_file);
+}
+
+// Read a piece at a time, so the config can be any size.
+#define CFG_CHUNK 512
+
+static void parse_config(bool may_format) {
+	FIL cfg_file;
+
+	if (f_open(&cfg_file, CFGFILE_NAME,
+				FA_READ | FA_OPEN_EXISTING) != FR_OK) {
+		led_panic("RCFG");
 	}
 
-	// tokens-1 to guarantee that there's always room for a value after
-	// our string key..
-	for (int i=1; i<(num_tokens-1); i++) {
-		jsmntok_t *t = tokens + i;
-		jsmntok_t *next = t + 1;
+	struct cfg_parser parser;
 
-		if (skip_count) {
-			skip_count--;
+	cfgparse_init(&parser, handle_config_key);
 
-			if ((t->type == JSMN_ARRAY) ||
-					(t->type == JSMN_OBJECT)) {
-				skip_count += t->size;
-			}
+	UINT amount;
+	uint32_t total = 0;
 
-			continue;
+	do {
+		if (FR_OK != f_read(&cfg_file, rx_scratch, CFG_CHUNK,
+					&amount)) {
+			led_panic("RCFG");
 		}
 
-		if (t->type != JSMN_STRING) {
+		if (cfgparse_feed(&parser, rx_scratch, amount)) {
+			// ..--..
 			led_panic("?");
 		}
 
-		/* OK, it's a string. */
+		total += amount;
+	} while (amount == CFG_CHUNK);
 
-		if (compare_key(cfg_buf, t, "startupMorse", JSMN_STRING)) {
-			int len = MIN(next->end - next->start, sizeof(cfg_morse)-1);
+	if (total == 0) {
+		led_panic("RCFG");
+	}
 
-			memcpy(cfg_morse, cfg_buf + next->start, len);
-			cfg_morse[len] = 0;
-		} else if (compare_key(cfg_buf, t, "useSPI", JSMN_PRIMITIVE)) {
-			if (parse_bool(cfg_buf, next)) {
-				// XXX SPI not supported yet
-				led_panic("?SPI?");
-			}
-		} else if (compare_key(cfg_buf, t, "baudRate", JSMN_PRIMITIVE)) {
-			cfg_baudrate = parse_num(cfg_buf, next);
-		} else if (compare_key(cfg_buf, t, "preallocBytes", JSMN_PRIMITIVE)) {
-			cfg_prealloc = parse_num(cfg_buf, next);
-		} else if (compare_key(cfg_buf, t, "preallocGrow", JSMN_PRIMITIVE)) {
-			cfg_prealloc_grow = parse_bool(cfg_buf, next);
-		} else if (compare_key(cfg_buf, t, "builtInSelfTest", JSMN_PRIMITIVE)) {
-			cfg_bist = parse_bool(cfg_buf, next);
-		}
+	// Minimal should be one whole object
+	if (cfgparse_finish(&parser)) {
+		// ..--..
+		led_panic("?");
+	}
 
-		i++;	// Skip the value too on next iter.
+	bool format = (cfg_format_key >= 0) && may_format;
+
+	// Formatting takes the config with it, so it has to be in memory
+	// to put back.
+	if (format) {
+		if ((total > RX_SCRATCH_LEN) ||
+				(f_lseek(&cfg_file, 0) != FR_OK) ||
+				(f_read(&cfg_file, rx_scratch, total,
+					&amount) != FR_OK) ||
+				(amount != total)) {
+			led_panic("RCFG");
+		}
 	}
 
 	f_close(&cfg_file);
 
+	if (format) {
+		format_card(rx_scratch, total, cfg_format_key);
+	}
+}
+
+// Try to load a config file.  If it doesn't exist, create it.
+// If we can't load after that, PANNNNIC.  Without may_format, formatCard
+// is left for a later boot.
+void process_config(bool may_format) {
+	FILINFO info;
+
+	write_config(lager_cfg, sizeof(lager_cfg));
+
+	if (f_stat(CFGFILE_NAME, &info) != FR_OK) {
+		led_panic("RCFG");
+	}
+
+	uint32_t schema = cfg_schema();
+
+	if (!load_config_cache(&info, schema)) {
+		parse_config(may_format);
+
+		// Not cached if formatCard was put off, so the next boot
+		// parses the config and sees it again.
+		if ((cfg_format_key < 0) || may_format) {
+			save_config_cache(schema);
+		}
+	}
+
+	// Sent from systick, so it doesn't hold up logging.
 	if (cfg_morse[0]) {
-		led_send_morse(cfg_morse);
+		led_queue_morse(cfg_morse);
 	}
 }
 
@@ -295,250 +693,1540 @@ static int advance_filename(char *f) {
 
 }
 
-static void open_log(FIL *fil) {
-	char filename[] = LOGNAME_FMT;
-	FRESULT res;
+// Creates the next free log name in the directory named by the start of
+// path.  Gives up after max_tries names, so that a directory never holds
+// more than that many logs and a lookup in it stays cheap.
+static FRESULT open_log_in_dir(FIL *fil, char *path, char *filename,
+		uint32_t max_tries) {
+	FRESULT res = f_open(fil, path, FA_WRITE | FA_CREATE_NEW);
 
-	res = f_open(fil, filename, FA_WRITE | FA_CREATE_NEW);
+	for (uint32_t tries = 1; res == FR_EXIST; tries++) {
+		if (tries >= max_tries) {
+			return FR_DENIED;
+		}
 
-	while (res == FR_EXIST) {
 		if (advance_filename(filename)) {
-			// ..-. .. .-.. . ...
-			led_panic("FILES");
+			return FR_DENIED;
 		}
 
-		// This is likely n^2 or worse with number of config files
-		res = f_open(fil, filename, FA_WRITE | FA_CREATE_NEW);
-	}
-
-	if (res != FR_OK) {
-		// --- .-... --- --.
-		led_panic("OLOG");
-	}
-
-	if (cfg_prealloc > 0) {
-		// Attempt to preallocate contig space for the logfile
-		// Best effort only-- figure it's better to keep going if
-		// we can't alloc it at all.
-
-		f_expand(fil, cfg_prealloc, cfg_prealloc_grow ? 1 : 0);
+		res = f_open(fil, path, FA_WRITE | FA_CREATE_NEW);
 	}
 
+	return res;
 }
 
-static void fill_lcg(uint32_t *state, uint32_t *buf, int num_words) {
-	register uint32_t s = *state;
-
-	for (register int i=0; i<num_words; i++) {
-		// Constants for mixed congruential generator from
-		// Numerical Recipes.
-		s *= 1664525;
-		s += 1013904223;
-
-		buf[i] = s;
-	}
-
-	*state = s;
-}
+// Logs go into logs000/, logs001/, ... each capped at cfg_logs_per_dir
+// entries.  Keeps the root directory small (it has a fixed number of
+// entries on FAT16) and bounds the linear dir_find scan on every open.
+static void open_log_subdir(FIL *fil) {
+	char *path = log_path;
+	char *slash = path + sizeof(LOGDIR_FMT) - 1;
+	FILINFO fno;
+	bool found = false;
 
-static int compare_lcg(uint32_t *state, uint32_t *buf, int num_words) {
-	register uint32_t s = *state;
+	// Find the last directory in the sequence; one f_stat per full
+	// directory, rather than one per log file.
+	*slash = 0;
 
-	for (register int i=0; i<num_words; i++) {
-		// Constants for mixed congruential generator from
-		// Numerical Recipes.
-		s *= 1664525;
-		s += 1013904223;
+	while (f_stat(path, &fno) == FR_OK) {
+		found = true;
 
-		if (buf[i] != s) {
-			return -1;
+		if (advance_filename(path)) {
+			// ..-. .. .-.. . ...
+			led_panic("FILES");
 		}
 	}
 
-	*state = s;
-
-	return 0;
-}
-
-static void do_bist(void) {
-	/* 120K.  To test writing 6 megabytes, write 50 chunks of this */
-	uint32_t buf[120*1024 / sizeof(uint32_t)];
+	if (found) {
+		// Step back to the last one that exists.  The digits can't
+		// underflow because we advanced at least once.
+		char *d = slash - 1;
 
-	uint32_t state = 0;
+		while (*d == '0') {
+			*d = '9';
+			d--;
+		}
 
-	FRESULT res;
-	UINT cnt;
-	FIL fil;
+		(*d)--;
 
-	f_unlink("bist.txt");
+		*slash = '/';
 
-	/* Create a bist text file */
-	res = f_open(&fil, "bist.txt", FA_WRITE | FA_CREATE_NEW);
-	if (res != FR_OK) {
-		led_panic("BISTOPEN");
-	}
+		FRESULT res = open_log_in_dir(fil, path, slash + 1,
+				cfg_logs_per_dir);
 
+		if (res != FR_DENIED) {
+			if (res != FR_OK) {
+				// --- .-... --- --.
+				led_panic("OLOG");
+			}
 
-	for (int i=0; i<50; i++) {
-		fill_lcg(&state, buf, NELEMENTS(buf));
+			return;
+		}
 
-		res = f_write(&fil, buf, sizeof(buf), &cnt);
+		// That one's full, move on to a fresh directory.
+		*slash = 0;
 
-		if (res != FR_OK) {
-			led_panic("BISTWERR");
+		if (advance_filename(path)) {
+			led_panic("FILES");
 		}
 
-		if (cnt != sizeof(buf)) {
-			led_panic("BISTWSIZE");
-		}
+		memcpy(slash + 1, LOGNAME_FMT, sizeof(LOGNAME_FMT));
 	}
 
-	f_close(&fil);
+	if (f_mkdir(path) != FR_OK) {
+		// --- -.. .. .-.
+		led_panic("ODIR");
+	}
 
-	res = f_open(&fil, "bist.txt", FA_READ | FA_OPEN_EXISTING);
+	*slash = '/';
 
-	if (res != FR_OK) {
-		led_panic("BISTOPEN2");
+	if (f_open(fil, path, FA_WRITE | FA_CREATE_NEW) != FR_OK) {
+		led_panic("OLOG");
 	}
+}
 
-	state = 0;
-	for (int i=0; i<50; i++) {
-		res = f_read(&fil, buf, sizeof(buf), &cnt);
+// preallocChain links the log's whole cluster chain up front but leaves
+// its size alone, and the log is never closed-- so whatever the chain has
+// past the end would stay allocated for good (and look like an error to
+// fsck).  The log's path is kept in CHAINFILE_NAME, and the next boot
+// trims its chain back to its size.  Uses fil, before the log's opened.
+static void trim_last_log(FIL *fil) {
+	char path[sizeof(log_path)];
+	UINT cnt;
 
-		if (res != FR_OK) {
-			led_panic("BISTRERR");
-		}
+	if (f_open(fil, CHAINFILE_NAME, FA_READ | FA_OPEN_EXISTING) != FR_OK) {
+		return;
+	}
 
-		if (cnt != sizeof(buf)) {
-			led_panic("BISTRSIZE");
-		}
+	bool ok = (f_read(fil, path, sizeof(path), &cnt) == FR_OK) &&
+		(cnt == sizeof(path));
 
-		if (compare_lcg(&state, buf, NELEMENTS(buf))) {
-			led_panic("DERR");
-		}
-	}
+	f_close(fil);
 
-	res = f_unlink("bist.txt");
+	path[sizeof(path) - 1] = 0;
 
-	if (res != FR_OK) {
-		led_panic("ERAS");
+	// At the end, f_truncate drops whatever's linked past it.
+	if (ok && (f_open(fil, path, FA_WRITE | FA_OPEN_EXISTING) == FR_OK)) {
+		if ((f_lseek(fil, f_size(fil)) != FR_OK) ||
+				(f_truncate(fil) != FR_OK) ||
+				(f_close(fil) != FR_OK)) {
+			// . .-. .-.
+			led_panic("SERR");
+		}
 	}
 
-	led_panic("SI");	// ... ..
+	f_unlink(CHAINFILE_NAME);
 }
 
-static void do_usart_logging(void) {
-	char buf[125*1024];
-
-	usart_init(cfg_baudrate, buf, sizeof(buf));
+static void record_log(FIL *fil) {
+	UINT cnt;
 
-	FIL log_file;
+	if ((f_open(fil, CHAINFILE_NAME,
+				FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) ||
+			(f_write(fil, log_path, sizeof(log_path), &cnt) !=
+			 FR_OK) ||
+			(cnt != sizeof(log_path)) ||
+			(f_close(fil) != FR_OK)) {
+		led_panic("SERR");
+	}
+}
 
-	open_log(&log_file);
+static void open_log(FIL *fil) {
+	trim_last_log(fil);
 
-	while (1) {
-		const char *pos;
-		unsigned int amt;
+	if (cfg_logs_per_dir > 0) {
+		open_log_subdir(fil);
+	} else {
+		char *filename = log_path;
+		FRESULT res;
 
-		// 50 ticks == 200ms, prefer 512 byte sector alignment,
-		// and >= 2560 byte chunks are best
-		// Never get more than about 2/5 of the buffer (40 * 1024)--
-		// because we want to finish the IO and free it up
-		pos = usart_receive_chunk(50, 512, 5*512,
-				40*1024, &amt);
+		memcpy(filename, LOGNAME_FMT, sizeof(LOGNAME_FMT));
 
-		// Could consider if pos is short, waiting a little longer
-		// (400-600ms?) next time...
+		res = f_open(fil, filename, FA_WRITE | FA_CREATE_NEW);
 
-		led_set(true);	// Illuminate LED during IO
+		while (res == FR_EXIST) {
+			if (advance_filename(filename)) {
+				// ..-. .. .-.. . ...
+				led_panic("FILES");
+			}
 
-		FRESULT res;
+			// This is likely n^2 or worse with number of config files
+			res = f_open(fil, filename, FA_WRITE | FA_CREATE_NEW);
+		}
 
-		if (!amt) {
-			// If nothing has happened in 200ms, flush our
-			// buffers.
-			res = f_sync(&log_file);
+		if (res != FR_OK) {
+			// --- .-... --- --.
+			led_panic("OLOG");
+		}
+	}
 
-			if (res != FR_OK) {
-				// . .-. .-.
-				led_panic("SERR");
+	if (cfg_prealloc > 0) {
+		// Attempt to preallocate contig space for the logfile
+		// Best effort only-- figure it's better to keep going if
+		// we can't alloc it at all.
+		//
+		// preallocChain links the whole cluster chain now but leaves
+		// the file size alone, so syncs while logging only need to
+		// rewrite the directory entry-- never the FAT or FSInfo.
+		BYTE opt = 0;
+
+		if (cfg_prealloc_grow) {
+			opt = 1;
+		} else if (cfg_prealloc_chain) {
+			opt = 2;
+
+			// Recorded for trim_last_log, with the log closed
+			// meanwhile to borrow its FIL.
+			if (f_close(fil) != FR_OK) {
+				led_panic("OLOG");
 			}
-		} else {
-			UINT written;
 
-			res = f_write(&log_file, pos, amt, &written);
-
-			if (res != FR_OK) {
-				// . .-. .-.
-				led_panic("WERR");
-			}
+			record_log(fil);
 
-			if (written != amt) {
-				// ..-. ..- .-.. .-..
-				led_panic("FULL");
+			if (f_open(fil, log_path,
+					FA_WRITE | FA_OPEN_EXISTING) != FR_OK) {
+				led_panic("OLOG");
 			}
 		}
 
-		led_set(false);
+		f_expand(fil, cfg_prealloc, opt);
 	}
+
 }
 
-int main() {
-	RCC_DeInit();
+// When stageTail is set, only whole sectors are ever written to the log.
+// The partial sector at the end is left in the receive buffer, and at
+// sync time it's copied here instead-- so no log sector is written twice.
+// On the next boot, a stashed tail that matches the synced length of its
+// log is appended to it.
+#define TAIL_MAGIC 0x4c544c4f	/* "OLTL" */
+
+static struct {
+	char data[512];
+	uint32_t magic;
+	uint32_t offset;
+	uint32_t len;
+	char path[sizeof(log_path)];
+	char pad[512 - 3 * sizeof(uint32_t) - sizeof(log_path)];
+} tail_stash __attribute__((aligned(4)));
+
+static FIL tail_file;
+
+static void recover_tail(void) {
+	UINT cnt;
 
-	// Wait for internal oscillator settle.
-	while (RCC_GetFlagStatus(RCC_FLAG_HSIRDY) == RESET);
+	if (f_read(&tail_file, &tail_stash, sizeof(tail_stash), &cnt) != FR_OK) {
+		return;
+	}
 
-	// Turn on the external oscillator
-	RCC_HSEConfig(RCC_HSE_ON);
+	if ((cnt != sizeof(tail_stash)) || (tail_stash.magic != TAIL_MAGIC)) {
+		return;
+	}
 
-	if (RCC_WaitForHSEStartUp() == ERROR) {
-		// Settle for HSI, and flag error.
+	if (tail_stash.len && (tail_stash.len <= sizeof(tail_stash.data))) {
+		FIL fil;
 
-		// Program the PLL.
-		RCC_PLLConfig(RCC_PLLSource_HSI,
-				8,	/* PLLM = /8 = 2MHz */
-				96,	/* PLLN = *96 = 192MHz */
-				2,	/* PLLP = /2 = 96MHz, slight underclock */
-				5	/* PLLQ = /5 = 38.4MHz, underclock SDIO
-					 * (Maximum is 48MHz)  Will get a 19.2MHz
-					 * SD card clock from dividing by 2, or
-					 * 9.6MBps at 4 bits wide.
-					 */
-			);
+		tail_stash.path[sizeof(tail_stash.path) - 1] = 0;
 
-		osc_err = true;
-	} else {
-		// Program the PLL.
-		RCC_PLLConfig(RCC_PLLSource_HSE,
-				4,	/* PLLM = /4 = 2MHz */
-				96,	/* PLLN = *96 = 192MHz */
-				2,	/* PLLP = /2 = 96MHz, slight underclock */
-				5	/* PLLQ = /5 = 38.4MHz, underclock SDIO
-					 * (Maximum is 48MHz)  Will get a 19.2MHz
-					 * SD card clock from dividing by 2, or
-					 * 9.6MBps at 4 bits wide.
-					 */
-			);
-	}
+		if (f_open(&fil, tail_stash.path,
+					FA_WRITE | FA_OPEN_EXISTING) == FR_OK) {
+			// Only if the log is still just as long as when the
+			// tail was stashed.
+			if ((f_size(&fil) == tail_stash.offset) &&
+					(f_lseek(&fil, tail_stash.offset) == FR_OK)) {
+				f_write(&fil, tail_stash.data, tail_stash.len,
+						&cnt);
+			}
+
+			f_close(&fil);
+		}
+	}
+
+	memset(&tail_stash, 0, sizeof(tail_stash));
+
+	f_lseek(&tail_file, 0);
+	f_write(&tail_file, &tail_stash, sizeof(tail_stash), &cnt);
+}
+
+static bool open_tail_stash(void) {
+	if (f_open(&tail_file, TAILFILE_NAME,
+				FA_READ | FA_WRITE | FA_OPEN_ALWAYS) != FR_OK) {
+		return false;
+	}
+
+	if (f_size(&tail_file) == 0) {
+		// One cluster allocated once, and never resized after, so
+		// stashing is a single 2 sector write with no FAT/dir update.
+		if (f_expand(&tail_file, sizeof(tail_stash), 1) != FR_OK) {
+			return false;
+		}
+
+		if (f_sync(&tail_file) != FR_OK) {
+			return false;
+		}
+
+		return true;
+	}
+
+	if (f_size(&tail_file) != sizeof(tail_stash)) {
+		return false;
+	}
+
+	recover_tail();
+
+	return true;
+}
+
+static void stash_tail(const char *data, unsigned int len, uint32_t offset) {
+	UINT written;
+
+	// More may have arrived since; that will be written in whole
+	// sectors soon enough.
+	if (len > sizeof(tail_stash.data)) {
+		len = sizeof(tail_stash.data);
+	}
+
+	memcpy(tail_stash.data, data, len);
+	tail_stash.magic = len ? TAIL_MAGIC : 0;
+	tail_stash.offset = offset;
+	tail_stash.len = len;
+	memcpy(tail_stash.path, log_path, sizeof(log_path));
+
+	if (f_lseek(&tail_file, 0) != FR_OK) {
+		led_panic("SERR");
+	}
+
+	if (f_write(&tail_file, &tail_stash, sizeof(tail_stash),
+				&written) != FR_OK) {
+		led_panic("SERR");
+	}
+}
+
+// Runtime statistics, for tuning buffering to a logging rate; with
+// writeStats set they're rewritten to stats.txt at each sync.
+static struct {
+	uint64_t bytes_logged;
+	uint32_t syncs;
+	uint32_t writes;
+	uint32_t max_write_us;
+
+	// Time spent waiting for data (mostly asleep), and over what period,
+	// since the last report
+	uint64_t idle_us;
+	uint32_t since;
+} run_stats;
+
+static void log_write(FIL *fil, const char *data, UINT len) {
+	UINT written;
+	uint32_t start = timebase_us();
+
+	FRESULT res = f_write(fil, data, len, &written);
+
+	uint32_t us = timebase_us() - start;
+
+	run_stats.writes++;
+
+	if (us > run_stats.max_write_us) {
+		run_stats.max_write_us = us;
+	}
+
+	if (res != FR_OK) {
+		// . .-. .-.
+		led_panic("WERR");
+	}
+
+	if (written != len) {
+		// ..-. ..- .-.. .-..
+		led_panic("FULL");
+	}
+}
+
+// Flight recorder mode: when ringBytes is set, we log into one fixed,
+// preallocated file, ring.bin, and wrap around when we reach the end.
+// The first sector holds this header; the ring data follows it.  To
+// read it back, take data from head to the end (if wraps is nonzero) and
+// then from the start up to head.
+#define RING_MAGIC 0x474e524f	/* "ORNG" */
+
+static struct {
+	uint32_t magic;
+	uint32_t data_size;	// Ring size in bytes, not counting the header
+	uint32_t head;		// Offset in the ring of the next byte written
+	uint32_t wraps;		// Times the head has gone back to the start
+	char pad[512 - 4 * sizeof(uint32_t)];
+} ring_hdr __attribute__((aligned(4)));
+
+static void ring_write_hdr(FIL *fil) {
+	FSIZE_t pos = f_tell(fil);
+
+	if (f_lseek(fil, 0) != FR_OK) {
+		led_panic("WERR");
+	}
+
+	log_write(fil, (const char *) &ring_hdr, sizeof(ring_hdr));
+
+	if (f_lseek(fil, pos) != FR_OK) {
+		led_panic("WERR");
+	}
+}
+
+static void open_ring(FIL *fil) {
+	// Whole sectors only
+	uint32_t size = (cfg_ring_bytes + 511) & ~511;
+	UINT cnt;
+
+	if (f_open(fil, RINGFILE_NAME,
+				FA_READ | FA_WRITE | FA_OPEN_ALWAYS) != FR_OK) {
+		// --- .-... --- --.
+		led_panic("OLOG");
+	}
+
+	if (f_size(fil) == size + sizeof(ring_hdr)) {
+		// Pick up where we left off, if the header makes sense.
+		if ((f_read(fil, &ring_hdr, sizeof(ring_hdr), &cnt) == FR_OK) &&
+				(cnt == sizeof(ring_hdr)) &&
+				(ring_hdr.magic == RING_MAGIC) &&
+				(ring_hdr.data_size == size) &&
+				(ring_hdr.head < size)) {
+			if (f_lseek(fil, sizeof(ring_hdr) + ring_hdr.head) !=
+					FR_OK) {
+				led_panic("OLOG");
+			}
+
+			return;
+		}
+	} else {
+		// Wrong size (or new).  Start over with a contiguous
+		// allocation, so writing and wrapping never touch the FAT.
+		if ((f_lseek(fil, 0) != FR_OK) || (f_truncate(fil) != FR_OK)) {
+			led_panic("OLOG");
+		}
+
+		if (f_expand(fil, size + sizeof(ring_hdr), 1) != FR_OK) {
+			led_panic("FULL");
+		}
+	}
+
+	memset(&ring_hdr, 0, sizeof(ring_hdr));
+	ring_hdr.magic = RING_MAGIC;
+	ring_hdr.data_size = size;
+
+	if (f_lseek(fil, sizeof(ring_hdr)) != FR_OK) {
+		led_panic("OLOG");
+	}
+
+	ring_write_hdr(fil);
+
+	if (f_sync(fil) != FR_OK) {
+		led_panic("SERR");
+	}
+}
+
+static void ring_write(FIL *fil, const char *data, UINT len) {
+	while (len) {
+		uint32_t room = ring_hdr.data_size -
+			(f_tell(fil) - sizeof(ring_hdr));
+		UINT amt = MIN(len, room);
+
+		log_write(fil, data, amt);
+
+		data += amt;
+		len -= amt;
+
+		if (amt == room) {
+			if (f_lseek(fil, sizeof(ring_hdr)) != FR_OK) {
+				led_panic("WERR");
+			}
+
+			ring_hdr.wraps++;
+		}
+	}
+
+	ring_hdr.head = f_tell(fil) - sizeof(ring_hdr);
+}
+
+static void store_write(FIL *fil, const char *data, UINT len) {
+	if (cfg_ring_bytes) {
+		ring_write(fil, data, len);
+	} else {
+		log_write(fil, data, len);
+	}
+}
+
+// Framed mode: received data is packed into struct logframe sectors (see
+// logframe.h) in a staging area, which is written out when it fills or
+// at sync time.  A partly filled frame is sealed short at sync, so synced
+// data is always on the card.
+#define FRAME_STAGE_SIZE (16*1024)
+
+static struct {
+	struct logframe *frames;
+	unsigned int num;	// Frames in the staging area
+	unsigned int cur;	// Frame being filled
+	uint32_t seq;
+	uint16_t flags;		// For the frame being filled
+	unsigned int spilled;	// usart_rx_spill_count() at the last seal
+} framer;
+
+static void frame_init(void *stage, unsigned int len) {
+	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_CRC, ENABLE);
+
+	framer.frames = stage;
+	framer.num = len / sizeof(struct logframe);
+	framer.cur = 0;
+	framer.seq = 0;
+	framer.flags = LOGFRAME_FLAG_START;
+	framer.spilled = usart_rx_spill_count();
+
+	memset(framer.frames, 0, sizeof(struct logframe));
+}
+
+static void frame_seal(void) {
+	struct logframe *f = framer.frames + framer.cur;
+	unsigned int spilled = usart_rx_spill_count();
+
+	if (spilled != framer.spilled) {
+		framer.flags |= LOGFRAME_FLAG_OVERFLOW;
+		framer.spilled = spilled;
+	}
+
+	f->magic = LOGFRAME_MAGIC;
+	f->seq = framer.seq++;
+	f->time_ms = systick_cnt * 4;
+	f->flags = framer.flags;
+	framer.flags = 0;
+
+	CRC_ResetDR();
+	f->crc = CRC_CalcBlockCRC((uint32_t *) f,
+			(sizeof(*f) - sizeof(f->crc)) / sizeof(uint32_t));
+
+	framer.cur++;
+}
+
+static void frame_flush(FIL *fil) {
+	if ((framer.cur < framer.num) && framer.frames[framer.cur].len) {
+		frame_seal();
+	}
+
+	if (framer.cur) {
+		store_write(fil, (const char *) framer.frames,
+				framer.cur * sizeof(struct logframe));
+	}
+
+	framer.cur = 0;
+	memset(framer.frames, 0, sizeof(struct logframe));
+}
+
+// Seal the current frame and move on to a fresh one.
+static void frame_advance(FIL *fil) {
+	frame_seal();
+
+	if (framer.cur == framer.num) {
+		frame_flush(fil);
+	} else {
+		memset(framer.frames + framer.cur, 0, sizeof(struct logframe));
+	}
+}
+
+static void frame_write(FIL *fil, const char *data, UINT len) {
+	while (len) {
+		struct logframe *f = framer.frames + framer.cur;
+		UINT amt = MIN(len, (UINT) (LOGFRAME_PAYLOAD - f->len));
+
+		memcpy(f->payload + f->len, data, amt);
+		f->len += amt;
+		data += amt;
+		len -= amt;
+
+		if (f->len == LOGFRAME_PAYLOAD) {
+			frame_advance(fil);
+		}
+	}
+}
+
+// Gap markers get a frame to themselves.
+static void frame_gap(FIL *fil, const struct loggap *marker) {
+	if (framer.frames[framer.cur].len) {
+		frame_advance(fil);
+	}
+
+	struct logframe *f = framer.frames + framer.cur;
+
+	memcpy(f->payload, marker, sizeof(*marker));
+	f->len = sizeof(*marker);
+	framer.flags |= LOGFRAME_FLAG_GAP;
+
+	frame_advance(fil);
+}
+
+// Data on its way to the card, framed or not.
+static void stream_write(FIL *fil, const char *data, UINT len) {
+	if (cfg_framed) {
+		frame_write(fil, data, len);
+	} else {
+		store_write(fil, data, len);
+	}
+}
+
+// Compressed mode: received data is cut into blocks of up to
+// LZBLOCK_MAX_RAW, and each is compressed on its own into a staging area
+// (see lzblock.h), which goes out when it fills or at sync.  The hash
+// table and staging area come off the end of the receive buffer.
+#define LZ_STAGE_SIZE (16*1024)
+#define LZ_TABLE_SIZE (sizeof(uint16_t) << LZ_HASH_BITS)
+
+static struct {
+	uint16_t *table;
+	uint8_t *stage;
+	unsigned int fill;
+} lz;
+
+// Bytes in, bytes out, and CPU cycles spent compressing.
+static struct {
+	uint64_t raw_bytes;
+	uint64_t stored_bytes;
+	uint64_t cycles;
+} lz_stats;
+
+static void lz_init(void *mem) {
+	lz.table = mem;
+	lz.stage = (uint8_t *) mem + LZ_TABLE_SIZE;
+	lz.fill = 0;
+}
+
+static void lz_flush(FIL *fil) {
+	if (lz.fill) {
+		stream_write(fil, (const char *) lz.stage, lz.fill);
+		lz.fill = 0;
+	}
+}
+
+static void lz_write(FIL *fil, const char *data, UINT len) {
+	while (len) {
+		UINT amt = MIN(len, LZBLOCK_MAX_RAW);
+		struct lzblock hdr = {
+			.magic = LZBLOCK_MAGIC,
+			.raw_len = amt
+		};
+
+		if (lz.fill + sizeof(hdr) + LZBLOCK_BOUND(amt) >
+				LZ_STAGE_SIZE) {
+			lz_flush(fil);
+		}
+
+		uint8_t *out = lz.stage + lz.fill + sizeof(hdr);
+		uint32_t start = timebase_cycles();
+		unsigned int clen = lz_compress((const uint8_t *) data, amt,
+				out, lz.table);
+
+		if (clen >= amt) {
+			// No gain; store it instead.
+			memcpy(out, data, amt);
+			clen = amt;
+			hdr.stored_len = amt | LZBLOCK_STORED;
+		} else {
+			hdr.stored_len = clen;
+		}
+
+		lz_stats.cycles += timebase_cycles() - start;
+		lz_stats.raw_bytes += amt;
+		lz_stats.stored_bytes += sizeof(hdr) + clen;
+
+		// Blocks are packed, so the header may not be aligned.
+		memcpy(lz.stage + lz.fill, &hdr, sizeof(hdr));
+		lz.fill += sizeof(hdr) + clen;
+
+		data += amt;
+		len -= amt;
+	}
+}
+
+// Record where received data was dropped, in place of the data.
+static void write_gap(FIL *fil, const struct usart_gap *gap) {
+	struct loggap marker = {
+		.magic = LOGGAP_MAGIC,
+		.time_ms = gap->time * 4,
+		.bytes = gap->bytes
+	};
+
+	marker.check = ~(marker.magic ^ marker.time_ms ^ marker.bytes);
+
+	// Keep it in order with data already compressed.
+	if (cfg_compress) {
+		lz_flush(fil);
+	}
+
+	if (cfg_framed) {
+		frame_gap(fil, &marker);
+		return;
+	}
+
+	store_write(fil, (const char *) &marker, sizeof(marker));
+
+	// Compressed blocks are packed regardless, but raw data is written
+	// in whole sectors.  Zero fill to the next sector boundary so what
+	// follows still is, rather than every later write straddling two.
+	if (!cfg_compress) {
+		static const char zeros[64];
+		UINT pad = -f_tell(fil) & 511;
+
+		while (pad) {
+			UINT amt = MIN(pad, sizeof(zeros));
+
+			store_write(fil, zeros, amt);
+			pad -= amt;
+		}
+	}
+}
+
+// End-to-end verification: with verifyLcg set, the received stream is
+// expected to be the LCG test pattern (see lcgcheck.h, and misc/lagerlcg
+// to send it).  It's checked as it arrives, while still being logged as
+// usual, and the results are rewritten to verify.txt at each sync.
+static struct lcg_check lcg_chk;
+
+static char *put_str(char *p, const char *s) {
+	while (*s) {
+		*p++ = *s++;
+	}
+
+	return p;
+}
+
+static char *put_num(char *p, uint64_t v) {
+	char digits[20];
+	int n = 0;
+
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+
+	while (n) {
+		*p++ = digits[--n];
+	}
+
+	return p;
+}
+
+// Appends a "name value" line.
+static char *put_field(char *p, const char *name, uint64_t value) {
+	p = put_str(p, name);
+	*p++ = ' ';
+	p = put_num(p, value);
+	*p++ = '\n';
+
+	return p;
+}
+
+// Replaces the contents of a file written once, like soak.txt.  Opened
+// each time, so the FIL only takes up stack while we're here.
+static void rewrite_text(const char *name, const char *text, UINT len) {
+	FIL fil;
+	UINT written;
+
+	if ((f_open(&fil, name, FA_WRITE | FA_OPEN_ALWAYS) != FR_OK) ||
+			(f_write(&fil, text, len, &written) != FR_OK) ||
+			(f_truncate(&fil) != FR_OK) ||
+			(f_close(&fil) != FR_OK)) {
+		// . .-. .-.
+		led_panic("SERR");
+	}
+}
+
+// The files rewritten at every sync (verify.txt, stats.txt) are opened
+// once, when logging starts, and kept at one sector padded with spaces.
+// An update overwrites that sector in place with a single write, and
+// leaves the FAT and directory alone.
+#define REPORT_LEN 512
+
+static FIL verify_file, stats_file;
+static char report_text[REPORT_LEN] __attribute__((aligned(4)));
+
+static void put_report(FIL *fil, char *end) {
+	UINT written;
+
+	memset(end, ' ', report_text + REPORT_LEN - end);
+	report_text[REPORT_LEN - 1] = '\n';
+
+	// A whole sector from a sector boundary goes straight to the card,
+	// not through the FIL's buffer.
+	if ((f_lseek(fil, 0) != FR_OK) ||
+			(f_write(fil, report_text, REPORT_LEN, &written) !=
+			 FR_OK) ||
+			(written != REPORT_LEN)) {
+		// . .-. .-.
+		led_panic("SERR");
+	}
+}
+
+static void open_report(FIL *fil, const char *name) {
+	if (f_open(fil, name, FA_WRITE | FA_OPEN_ALWAYS) != FR_OK) {
+		led_panic("SERR");
+	}
+
+	put_report(fil, report_text);
+
+	if ((f_truncate(fil) != FR_OK) || (f_sync(fil) != FR_OK)) {
+		led_panic("SERR");
+	}
+}
+
+static void write_verify(void) {
+	char *p = report_text;
+
+	p = put_field(p, "received", lcg_chk.received);
+	p = put_field(p, "good", lcg_chk.good);
+
+	if (lcg_chk.first_err == LCG_CHECK_NO_ERR) {
+		p = put_str(p, "firstError none\n");
+	} else {
+		p = put_field(p, "firstError", lcg_chk.first_err);
+	}
+
+	p = put_field(p, "errors", lcg_chk.errors);
+	p = put_field(p, "dropped", lcg_chk.dropped);
+	p = put_field(p, "duplicated", lcg_chk.duplicated);
+	p = put_field(p, "bytesPerSec", lcg_check_rate(&lcg_chk));
+
+	put_report(&verify_file, p);
+}
+
+static void write_stats(const struct chunk_tune *tune) {
+	char *p = report_text;
+	DWORD retries = 0;
+
+	// Idle share of the time since the last report
+	uint32_t ms = (systick_cnt - run_stats.since) * 4;
+	uint32_t idle_pct = ms ? run_stats.idle_us / ((uint64_t) ms * 10) : 100;
+
+	run_stats.idle_us = 0;
+	run_stats.since = systick_cnt;
+
+	disk_ioctl(0, GET_WRITE_RETRIES, &retries);
+
+	p = put_field(p, "uptimeMs", systick_cnt * 4);
+	p = put_field(p, "idlePercent", MIN(idle_pct, 100));
+	p = put_field(p, "bytesLogged", run_stats.bytes_logged);
+	p = put_field(p, "bufferBytes", tune->buf_len);
+	p = put_field(p, "highWater", usart_rx_high_water_mark());
+	p = put_field(p, "spilled", usart_rx_spill_count());
+	p = put_field(p, "chunkTimeoutMs", tune->timeout_us / 1000);
+	p = put_field(p, "chunkMin", tune->min_chunk);
+	p = put_field(p, "chunkMax", tune->max_chunk);
+	p = put_field(p, "syncs", run_stats.syncs);
+	p = put_field(p, "writes", run_stats.writes);
+	p = put_field(p, "maxWriteUs", run_stats.max_write_us);
+	p = put_field(p, "writeRetries", retries);
+
+	if (cfg_compress) {
+		p = put_field(p, "compressIn", lz_stats.raw_bytes);
+		p = put_field(p, "compressOut", lz_stats.stored_bytes);
+		p = put_field(p, "compressCycles", lz_stats.cycles);
+	}
+
+	put_report(&stats_file, p);
+}
+
+// Card operation trace, with traceDisk set; saved to trace.bin for
+// misc/lagerreplay.  Records are appended when the buffer fills and at
+// each sync.  Saving isn't traced itself, but does hold up logging.
+#define TRACE_RECS 512
+
+static struct disk_trace_rec *trace_recs;
+
+static void trace_save(const void *data, UINT len, bool append) {
+	FIL fil;
+	UINT written;
+
+	if ((f_open(&fil, TRACEFILE_NAME, FA_WRITE |
+				(append ? FA_OPEN_ALWAYS : FA_CREATE_ALWAYS)) !=
+				FR_OK) ||
+			(f_lseek(&fil, f_size(&fil)) != FR_OK) ||
+			(f_write(&fil, data, len, &written) != FR_OK) ||
+			(f_close(&fil) != FR_OK)) {
+		// . .-. .-.
+		led_panic("SERR");
+	}
+}
+
+static void trace_init(struct disk_trace_rec *recs) {
+	struct disk_trace_hdr hdr = {
+		.magic = DISK_TRACE_MAGIC,
+		.rec_size = sizeof(struct disk_trace_rec),
+		// Timed on the 1MHz timebase, which (unlike the cycle
+		// counter) carries on while the core sleeps.
+		.cycles_per_us = 1
+	};
+
+	trace_save(&hdr, sizeof(hdr), false);
+
+	trace_recs = recs;
+	disk_trace_start(trace_recs, TRACE_RECS);
+}
+
+static void trace_flush(void) {
+	unsigned int count = disk_trace_stop();
+
+	trace_save(trace_recs, count * sizeof(*trace_recs), true);
+
+	disk_trace_start(trace_recs, TRACE_RECS);
+}
+
+static void fill_lcg(uint32_t *state, uint32_t *buf, int num_words) {
+	register uint32_t s = *state;
+
+	for (register int i=0; i<num_words; i++) {
+		s = lcg_next(s);
+
+		buf[i] = s;
+	}
+
+	*state = s;
+}
+
+static int compare_lcg(uint32_t *state, uint32_t *buf, int num_words) {
+	register uint32_t s = *state;
+
+	for (register int i=0; i<num_words; i++) {
+		s = lcg_next(s);
+
+		if (buf[i] != s) {
+			return -1;
+		}
+	}
+
+	*state = s;
+
+	return 0;
+}
+
+#define BIST_BUF_SIZE (64*1024)
+
+static void do_bist(void) {
+	/* 64K.  To test writing 6 megabytes, write 96 chunks of this */
+	uint32_t *buf = (uint32_t *) rx_area;
+
+	usart_stop();
+
+	uint32_t state = 0;
+
+	FRESULT res;
+	UINT cnt;
+	FIL fil;
+
+	f_unlink("bist.txt");
+
+	/* Create a bist text file */
+	res = f_open(&fil, "bist.txt", FA_WRITE | FA_CREATE_NEW);
+	if (res != FR_OK) {
+		led_panic("BISTOPEN");
+	}
+
+
+	for (int i=0; i<96; i++) {
+		fill_lcg(&state, buf, BIST_BUF_SIZE / 4);
+
+		res = f_write(&fil, buf, BIST_BUF_SIZE, &cnt);
+
+		if (res != FR_OK) {
+			led_panic("BISTWERR");
+		}
+
+		if (cnt != BIST_BUF_SIZE) {
+			led_panic("BISTWSIZE");
+		}
+	}
+
+	f_close(&fil);
+
+	res = f_open(&fil, "bist.txt", FA_READ | FA_OPEN_EXISTING);
+
+	if (res != FR_OK) {
+		led_panic("BISTOPEN2");
+	}
+
+	state = 0;
+	for (int i=0; i<96; i++) {
+		res = f_read(&fil, buf, BIST_BUF_SIZE, &cnt);
+
+		if (res != FR_OK) {
+			led_panic("BISTRERR");
+		}
+
+		if (cnt != BIST_BUF_SIZE) {
+			led_panic("BISTRSIZE");
+		}
+
+		if (compare_lcg(&state, buf, BIST_BUF_SIZE / 4)) {
+			led_panic("DERR");
+		}
+	}
+
+	res = f_unlink("bist.txt");
+
+	if (res != FR_OK) {
+		led_panic("ERAS");
+	}
+
+	led_panic("SI");	// ... ..
+}
+
+// Card benchmark: time writes of each size from 512 bytes up to the
+// card's AU, sector aligned or not, syncing after every write, every 16,
+// or only at the end.  Results go to bench.csv, a line per combination,
+// with throughput in MB/s and per-write latency percentiles in us.
+#define BENCH_BYTES (2*1024*1024)
+#define BENCH_SAMPLES 1024
+#define BENCH_BUF_WORDS (64*1024 / sizeof(uint32_t))
+
+static void sort_u32(uint32_t *v, int n) {
+	// Shell sort; small and quick enough for this.
+	for (int gap = n / 2; gap; gap /= 2) {
+		for (int i = gap; i < n; i++) {
+			uint32_t t = v[i];
+			int j;
+
+			for (j = i; (j >= gap) && (v[j - gap] > t); j -= gap) {
+				v[j] = v[j - gap];
+			}
+
+			v[j] = t;
+		}
+	}
+}
+
+static void bench_write(FIL *fil, const void *buf, UINT buf_len,
+		uint32_t len) {
+	UINT cnt;
+
+	while (len) {
+		UINT amt = MIN(len, buf_len);
+
+		if ((f_write(fil, buf, amt, &cnt) != FR_OK) || (cnt != amt)) {
+			led_panic("BISTWERR");
+		}
+
+		len -= amt;
+	}
+}
+
+// One line of bench.csv.  No writes means the size was skipped; that's
+// reported as 0 bytes, with no rate or latencies.
+static void bench_result(FIL *csv, uint32_t size, uint32_t offset,
+		uint32_t sync_every, uint32_t *lat, uint32_t writes,
+		uint64_t total_us) {
+	uint64_t bytes = (uint64_t) size * writes;
+	char line[128];
+	char *p = line;
+	UINT cnt;
+
+	p = put_num(p, size);
+	*p++ = ',';
+	p = put_num(p, offset);
+	*p++ = ',';
+	p = put_num(p, sync_every);
+	*p++ = ',';
+	p = put_num(p, bytes);
+	*p++ = ',';
+
+	if (writes) {
+		uint32_t milli_mbps = total_us ? bytes * 1000 / total_us : 0;
+
+		sort_u32(lat, writes);
+
+		p = put_num(p, milli_mbps / 1000);
+		*p++ = '.';
+		*p++ = '0' + (milli_mbps / 100) % 10;
+		*p++ = '0' + (milli_mbps / 10) % 10;
+		*p++ = '0' + milli_mbps % 10;
+		*p++ = ',';
+		p = put_num(p, lat[writes / 2]);
+		*p++ = ',';
+		p = put_num(p, lat[writes * 99 / 100]);
+		*p++ = ',';
+		p = put_num(p, lat[writes - 1]);
+		*p++ = ',';
+	} else {
+		p = put_str(p, ",,,,");
+	}
+
+	p = put_num(p, clocks_core_hz / 1000000);
+	*p++ = ',';
+	p = put_num(p, clocks_sdio_hz / 1000);
+	*p++ = '\n';
+
+	if ((f_write(csv, line, p - line, &cnt) != FR_OK) ||
+			(f_sync(csv) != FR_OK)) {
+		led_panic("BISTWERR");
+	}
+}
+
+static void do_bench(void) {
+	// In the receive area, as nothing's logged; too big for the stack.
+	uint32_t *buf = (uint32_t *) rx_area;
+	uint32_t *lat = buf + BENCH_BUF_WORDS;
+	uint32_t state = 0;
+
+	static const uint16_t offsets[] = { 0, 256 };
+	static const uint8_t sync_everys[] = { 0, 16, 1 };
+
+	usart_stop();
+
+	fill_lcg(&state, buf, BENCH_BUF_WORDS);
+
+	uint32_t au_sectors = 0;
+	sd_get_au_sectors(&au_sectors);
+
+	uint32_t max_size = au_sectors ? au_sectors * 512 : 4*1024*1024;
+
+	// Each run writes BENCH_BYTES, but at most BENCH_SAMPLES writes and
+	// at least 4.
+	uint32_t max_run = MAX(BENCH_BYTES, 4 * max_size);
+	uint32_t min_run = 4 * 512;
+
+	FIL fil, csv;
+	UINT cnt;
+
+	if ((f_open(&fil, BENCHFILE_NAME,
+				FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) ||
+			(f_open(&csv, BENCHCSV_NAME,
+				FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)) {
+		led_panic("BISTOPEN");
+	}
+
+	// Contiguous, so we time the card rather than the FAT.  A big AU can
+	// ask for more than a small or fragmented card has in one piece;
+	// then the biggest sizes are skipped.
+	while (f_expand(&fil, max_run + 512, 1) != FR_OK) {
+		max_run /= 2;
+
+		if (max_run < min_run) {
+			led_panic("FULL");
+		}
+	}
+
+	static const char header[] =
+		"size,offset,syncEvery,bytes,mbPerSec,p50Us,p99Us,maxUs,"
+		"coreMHz,sdioKHz\n";
+
+	if (f_write(&csv, header, sizeof(header) - 1, &cnt) != FR_OK) {
+		led_panic("BISTWERR");
+	}
+
+	for (int o = 0; o < NELEMENTS(offsets); o++) {
+		for (int s = 0; s < NELEMENTS(sync_everys); s++) {
+			for (uint32_t size = 512; size <= max_size; size *= 2) {
+				uint32_t writes = MAX(4, MIN(BENCH_BYTES / size,
+							BENCH_SAMPLES));
+				uint32_t sync_every = sync_everys[s];
+				uint64_t total_us = 0;
+
+				if (writes * size > max_run) {
+					bench_result(&csv, size, offsets[o],
+							sync_every, lat, 0, 0);
+					continue;
+				}
+
+				led_set(true);
+
+				if (f_lseek(&fil, offsets[o]) != FR_OK) {
+					led_panic("BISTWERR");
+				}
+
+				for (uint32_t i = 0; i < writes; i++) {
+					uint32_t start = timebase_us();
+
+					bench_write(&fil, buf,
+							BENCH_BUF_WORDS * 4,
+							size);
+
+					if (sync_every &&
+						!((i + 1) % sync_every) &&
+						(f_sync(&fil) != FR_OK)) {
+						led_panic("SERR");
+					}
+
+					lat[i] = timebase_us() - start;
+					total_us += lat[i];
+				}
+
+				// Whatever's left buffered counts toward
+				// throughput, but isn't a write's latency.
+				uint32_t start = timebase_us();
+
+				if (f_sync(&fil) != FR_OK) {
+					led_panic("SERR");
+				}
+
+				total_us += timebase_us() - start;
+
+				led_set(false);
+
+				bench_result(&csv, size, offsets[o], sync_every,
+						lat, writes, total_us);
+			}
+		}
+	}
+
+	f_close(&csv);
+	f_close(&fil);
+
+	if (f_unlink(BENCHFILE_NAME) != FR_OK) {
+		led_panic("ERAS");
+	}
+
+	led_panic("BD");	// -... -..
+}
+
+// Soak test: with soakRate and soakSeconds set, a generator puts the LCG
+// test pattern into the receive buffer at soakRate bytes/s on average,
+// for soakSeconds, as though it came from the serial port, and the usual
+// logging path stores it.  Data comes in bursts at soakPeak bytes/s
+// (default soakRate, i.e. smooth) for part of each SOAK_PERIOD_MS.  When
+// it's done and stored, soak.txt records the receive buffer's high water
+// mark and anything dropped.  verifyLcg can be set as well, to check the
+// pattern end to end.
+#define SOAK_PERIOD_MS 100
+
+static struct {
+	uint32_t state;
+	uint32_t credit;	// In thousandths of a byte
+	uint32_t ms;
+	uint64_t generated;
+	volatile bool done;
+} soak;
+
+static void soak_tick(void) {
+	if (TIM_GetITStatus(TIM4, TIM_IT_Update) != SET) {
+		return;
+	}
+
+	TIM_ClearITPendingBit(TIM4, TIM_IT_Update);
+
+	if (++soak.ms > cfg_soak_seconds * 1000) {
+		TIM_Cmd(TIM4, DISABLE);
+		soak.done = true;
+		return;
+	}
+
+	// Bytes/s is thousandths of a byte per ms.
+	if ((soak.ms % SOAK_PERIOD_MS) * cfg_soak_peak <
+			SOAK_PERIOD_MS * cfg_soak_rate) {
+		soak.credit += cfg_soak_peak;
+	}
+
+	// Whole words only; the rest waits for the next tick.
+	unsigned int words = soak.credit / 4000;
+
+	soak.credit -= words * 4000;
+	soak.generated += words * 4;
+
+	while (words) {
+		uint32_t buf[64];
+		unsigned int amt = MIN(words, NELEMENTS(buf));
+
+		fill_lcg(&soak.state, buf, amt);
+		usart_inject((const char *) buf, amt * sizeof(uint32_t));
+
+		words -= amt;
+	}
+}
+
+static void soak_start(void) {
+	if (cfg_soak_peak < cfg_soak_rate) {
+		cfg_soak_peak = cfg_soak_rate;
+	}
+
+	// Timer clock (the core's) to 1MHz, and a 1ms period
+	TIM_TimeBaseInitTypeDef tim_def = {
+		.TIM_Prescaler = clocks_core_hz / 1000000 - 1,
+		.TIM_CounterMode = TIM_CounterMode_Up,
+		.TIM_Period = 1000 - 1,
+		.TIM_ClockDivision = TIM_CKD_DIV1
+	};
+
+	TIM_TimeBaseInit(TIM4, &tim_def);
+	TIM_ClearITPendingBit(TIM4, TIM_IT_Update);
+	TIM_ITConfig(TIM4, TIM_IT_Update, ENABLE);
+
+	// Same priority as the USART interrupt; see usart_inject.
+	NVIC_InitTypeDef intr = {
+		.NVIC_IRQChannel = TIM4_IRQn,
+		.NVIC_IRQChannelCmd = ENABLE
+	};
+
+	NVIC_Init(&intr);
+
+	TIM_Cmd(TIM4, ENABLE);
+}
+
+static void soak_finish(unsigned int buf_len) {
+	char text[256];
+	char *p = text;
+	unsigned int dropped = usart_rx_spill_count();
+
+	p = put_field(p, "rateBytesPerSec", cfg_soak_rate);
+	p = put_field(p, "peakBytesPerSec", cfg_soak_peak);
+	p = put_field(p, "seconds", cfg_soak_seconds);
+	p = put_field(p, "generated", soak.generated);
+	p = put_field(p, "bufferBytes", buf_len);
+	p = put_field(p, "highWater", usart_rx_high_water_mark());
+	p = put_field(p, "dropped", dropped);
+
+	rewrite_text(SOAKFILE_NAME, text, p - text);
+
+	if (dropped) {
+		led_panic("LOSS");	// .-.. --- ... ...
+	}
+
+	led_panic("SOAK");	// ... --- .- -.-
+}
+
+// How long input must stay quiet before buffers are flushed.  Counted
+// separately from the receive timeout, which the tuner may shorten well
+// below this; a short lull between bursts shouldn't cost a sync.
+#define IDLE_SYNC_US 200000
+
+static void do_usart_logging(void) {
+	char *buf = rx_area;
+
+	// Before the rest of the buffer's in use for receiving, borrow it
+	// to read the FAT in big chunks and index the free space, so
+	// preallocation below doesn't have to crawl the FAT a sector at a
+	// time.  That's a scan of the whole FAT, so only pay for it when
+	// something is going to preallocate; plain logging just appends.
+	if (cfg_prealloc > 0 || cfg_ring_bytes > 0) {
+		f_buildidx("0:", rx_scratch, RX_SCRATCH_LEN);
+	}
+
+	// Framed and compressed modes need working space; take it off the
+	// end of the receive buffer.
+	unsigned int rx_len = sizeof(rx_area);
+
+	if (cfg_framed) {
+		rx_len -= FRAME_STAGE_SIZE;
+		frame_init(buf + rx_len, FRAME_STAGE_SIZE);
+	}
+
+	if (cfg_compress) {
+		rx_len -= LZ_TABLE_SIZE + LZ_STAGE_SIZE;
+		lz_init(buf + rx_len);
+	}
+
+	if (cfg_trace_disk) {
+		rx_len -= TRACE_RECS * sizeof(struct disk_trace_rec);
+		trace_init((struct disk_trace_rec *) (buf + rx_len));
+	}
+
+	// Capture's been running since boot at the start of the buffer;
+	// let it have the rest.
+	usart_grow_buffer(rx_len);
+
+	FIL log_file;
+
+	bool ring = cfg_ring_bytes > 0;
+
+	// Stashed tails are located by log length, which preallocGrow
+	// and the ring file fix up front, so those don't mix.  Framed mode
+	// seals short frames at sync instead, and a raw tail can't be
+	// appended to a compressed log.
+	bool stage_tail = cfg_stage_tail && !cfg_prealloc_grow && !ring &&
+		!cfg_framed && !cfg_compress && open_tail_stash();
+
+	lcg_check_init(&lcg_chk);
+	run_stats.since = systick_cnt;
+
+	if (cfg_verify_lcg) {
+		open_report(&verify_file, VERIFYFILE_NAME);
+	}
+
+	if (cfg_write_stats) {
+		open_report(&stats_file, STATSFILE_NAME);
+	}
+
+	if (ring) {
+		open_ring(&log_file);
+	} else {
+		open_log(&log_file);
+	}
+
+	bool soaking = cfg_soak_rate && cfg_soak_seconds;
+
+	if (soaking) {
+		soak_start();
+	}
+
+	// Sleep while waiting for data, and after idleClockMs of quiet slow
+	// the core down too.  Not while soaking: the soak timer would slow
+	// along with it.
+	power_init(soaking ? 0 : cfg_idle_clock_ms, cfg_baudrate);
+
+	// syncInterval is in ms; systick is 4ms.
+	uint32_t sync_ticks = cfg_sync_interval / 4;
+	uint32_t last_sync = systick_cnt;
+	uint32_t quiet_us = 0;
+	bool unsynced = false;
+	unsigned int stashed_len = 0;
+
+	// Chunk timeout and size limits; fixed unless autoTune is set.
+	struct chunk_tune tune;
+
+	chunk_tune_init(&tune, rx_len);
+
+	uint32_t pass_start = timebase_us();
+
+	while (1) {
+		const char *pos;
+		unsigned int amt;
+
+		// Prefer 512 byte sector alignment
+		pos = usart_receive_chunk(tune.timeout_us, 512,
+				tune.min_chunk, tune.max_chunk, stage_tail,
+				&amt);
 
-	// Get the PLL starting.
-	RCC_PLLCmd(ENABLE);
+		uint32_t store_start = timebase_us();
 
-	// Program this first, just in case we coasted in here with other periphs
-	// already enabled.  The loader does all of this stuff, but who knows,
-	// maybe in the future our startup code will do less of this.
+		run_stats.idle_us += store_start - pass_start;
 
-	RCC_HCLKConfig(RCC_SYSCLK_Div1);	/* AHB = 96MHz */
-	RCC_PCLK1Config(RCC_HCLK_Div2);		/* APB1 = 48MHz (lowspeed domain) */
-	RCC_PCLK2Config(RCC_HCLK_Div1);		/* APB2 = 96MHz (fast domain) */
-	RCC_TIMCLKPresConfig(RCC_TIMPrescDesactivated);
-			/* "Desactivate"... the timer prescaler */
+		if (amt) {
+			quiet_us = 0;
+		} else if (quiet_us < IDLE_SYNC_US) {
+			quiet_us += store_start - pass_start;
+		}
+
+		if (!cfg_led_fill) {
+			led_set(true);	// Illuminate LED during IO
+		}
+
+		FRESULT res;
+
+		// Any overflow right before this chunk gets marked first.
+		struct usart_gap gap;
+
+		if (usart_take_gap(&gap)) {
+			write_gap(&log_file, &gap);
+			unsynced = true;
+		}
+
+		if (amt) {
+			run_stats.bytes_logged += amt;
+
+			if (cfg_verify_lcg) {
+				lcg_check_feed(&lcg_chk, (const uint8_t *) pos,
+						amt, systick_cnt * 4);
+			}
+
+			if (cfg_compress) {
+				lz_write(&log_file, pos, amt);
+			} else {
+				stream_write(&log_file, pos, amt);
+			}
+
+			unsynced = true;
+		}
+
+		if (trace_recs && disk_trace_full()) {
+			trace_flush();
+		}
+
+		// If nothing has arrived in IDLE_SYNC_US, flush our buffers.
+		// Skip it if nothing's changed since the last sync, or
+		// if we synced less than syncInterval ago.  When an interval
+		// is configured, also sync on that period while data is
+		// streaming, so it bounds how much we can lose.
+		const char *tail = NULL;
+		unsigned int tail_len = 0;
+
+		if (stage_tail) {
+			tail = usart_peek_partial(&tail_len);
+		}
+
+		bool restash = stage_tail &&
+			((tail_len != stashed_len) || (unsynced && tail_len));
+
+		uint32_t since_sync = systick_cnt - last_sync;
+
+		if ((unsynced || restash) && (since_sync >= sync_ticks) &&
+				((quiet_us >= IDLE_SYNC_US) || sync_ticks)) {
+			if (unsynced) {
+				if (cfg_compress) {
+					lz_flush(&log_file);
+				}
+
+				if (cfg_framed) {
+					frame_flush(&log_file);
+				}
+
+				if (ring) {
+					ring_write_hdr(&log_file);
+				}
+
+				res = f_sync(&log_file);
+
+				if (res != FR_OK) {
+					// . .-. .-.
+					led_panic("SERR");
+				}
+
+				run_stats.syncs++;
+
+				if (cfg_verify_lcg) {
+					write_verify();
+				}
+
+				if (cfg_write_stats) {
+					write_stats(&tune);
+				}
+
+				if (trace_recs) {
+					trace_flush();
+				}
+			}
+
+			if (restash) {
+				stash_tail(tail, tail_len, f_tell(&log_file));
+				stashed_len = tail_len;
+			}
+
+			last_sync = systick_cnt;
+			unsynced = false;
+		}
+
+		// Otherwise show how full the receive buffer is: a flicker
+		// when keeping up, near solid when about to lose data.
+		if (cfg_led_fill) {
+			led_show_fill(usart_rx_backlog(), rx_len);
+		} else {
+			led_set(false);
+		}
 
-	RCC_SYSCLKConfig(RCC_SYSCLKSource_PLLCLK);
+		uint32_t now = timebase_us();
 
-	/* SDIO peripheral clocked at 38.4MHz. * 3/8 = minimum APB2 = 14.4MHz,
-	 * and we have 96MHz.. so we're good ;) */
+		if (cfg_auto_tune) {
+			chunk_tune_update(&tune, amt,
+					now - pass_start, now - store_start,
+					usart_rx_backlog());
+		}
+
+		pass_start = now;
+
+		if (soaking && soak.done && !amt && !unsynced) {
+			soak_finish(rx_len);
+		}
+	}
+}
+
+int main() {
+	RCC_DeInit();
+
+	// Start at the clocks the config asked for last time, so (usually)
+	// nothing has to change once it's read.
+	RCC_APB1PeriphClockCmd(RCC_APB1Periph_PWR, ENABLE);
+
+	unsigned int early_profile = recall_backup(RTC_BKP_DR2,
+			CLOCK_PROFILE_STANDARD);
+	uint32_t early_baud = recall_backup(RTC_BKP_DR0, cfg_baudrate);
 
 	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOA |
 			RCC_AHB1Periph_GPIOB |
@@ -548,7 +2236,8 @@ int main() {
 			RCC_AHB1Periph_DMA2,
 			ENABLE);
 
-	RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM2 |
+	RCC_APB1PeriphClockCmd(RCC_APB1Periph_PWR |
+			RCC_APB1Periph_TIM2 |
 			RCC_APB1Periph_TIM3 |
 			RCC_APB1Periph_TIM4 |
 			RCC_APB1Periph_TIM5,
@@ -561,6 +2250,11 @@ int main() {
 			RCC_APB2Periph_SDIO,
 			ENABLE);
 
+	// After the peripherals' clocks, as this sets up systick and the
+	// timebase on TIM5 too.  Settles for HSI if the crystal doesn't
+	// start, and flags it.
+	osc_err = !clocks_setup(early_profile, early_baud);
+
 	/* Seize PA14/PA13 from SWD. */
 	GPIO_InitTypeDef swd_def = {
 		.GPIO_Pin = GPIO_Pin_14 | GPIO_Pin_13,
@@ -572,13 +2266,9 @@ int main() {
 
 	GPIO_Init(GPIOA, &swd_def);
 
-	// Program 3 wait states as necessary at >2.7V for 96MHz
-	FLASH_SetLatency(FLASH_Latency_3);
-
-	// Wait for the PLL to be ready.
-	while (RCC_GetFlagStatus(RCC_FLAG_PLLRDY) == RESET);
-
-	SysTick_Config(96000000/250);	/* 250Hz systick */
+	// Start receiving now, so what's sent while the card and config are
+	// set up is kept.
+	usart_init(early_baud, rx_area, RX_EARLY_LEN);
 
 	/* Real hardware has LED on PB9. (sink on) */
 	led_init_pin(GPIOB, GPIO_Pin_9, true);
@@ -588,10 +2278,19 @@ int main() {
 
 	if (osc_err) {
 		// blink an error; though this is nonfatal.
-		led_send_morse("XOSC ");
+		led_queue_morse("XOSC ");
 	}
 
-        if (sd_init(false)) {
+	// The loader leaves the card ready to use; take it over from there
+	// if we can, rather than going through its setup again.
+	bool handoff = handoff_valid(&boot_handoff);
+	bool resumed = handoff && (boot_handoff.flags & HANDOFF_CARD) &&
+		!sd_resume(&boot_handoff.card);
+	bool trial = handoff && (boot_handoff.flags & HANDOFF_TRIAL);
+
+	boot_handoff.magic = 0;
+
+        if (!resumed && sd_init(false)) {
                 // -.-. .- .-. -..
                 led_panic("CARD");
         }
@@ -601,12 +2300,42 @@ int main() {
                 led_panic("DATA ");
         }
 
-	process_config();
+	// On a trial boot the loader's watchdog is running until the boot
+	// is confirmed.  Formatting can outlast it, and a reset partway
+	// would lose the config and count against this image, so a format
+	// waits for a boot that isn't on trial.
+	process_config(!trial);
+
+	// The baud rate has a say in the clocks, so either changing means
+	// setting them up again.  That runs on HSI with the PLL off for a
+	// while, which capture and the card can't ride through; so remember
+	// the new settings and reset, to start on them before capture does.
+	// What was captured this boot is lost, but only the once, when the
+	// config changes.  If they won't stay remembered, resetting would
+	// never end; keep the clocks and just change the baud rate.
+	if ((cfg_clock_profile != early_profile) ||
+			(cfg_baudrate != early_baud)) {
+		if (remember_backup(RTC_BKP_DR0, cfg_baudrate) &&
+				remember_backup(RTC_BKP_DR2,
+					cfg_clock_profile)) {
+			NVIC_SystemReset();
+		}
+
+		usart_set_baud(cfg_baudrate);
+	}
+
+	if (trial) {
+		confirm_boot(boot_handoff.slot);
+	}
 
 	if (cfg_bist) {
 		do_bist();
 	}
 
+	if (cfg_bench) {
+		do_bench();
+	}
+
 	do_usart_logging();
 
 	return 0;
@@ -0,0 +1,93 @@
+// Power saving while waiting for data
+//
+// Copyright (c) 2016, dRonin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <stm32f4xx.h>
+
+#include <clocks.h>
+#include <power.h>
+#include <systick_handler.h>
+#include <usart.h>
+
+static uint32_t power_quiet_ticks;
+static uint32_t power_last_active;
+static unsigned int power_max_div;
+static volatile bool power_slowed;
+
+// From the receive interrupt
+static void power_wake(void)
+{
+	clocks_set_divider(1);
+	power_slowed = false;
+}
+
+static void power_idle(void)
+{
+	if (usart_rx_backlog()) {
+		power_last_active = systick_cnt;
+
+		// Data that didn't come through the receive interrupt (a
+		// soak test's) doesn't wake us; catch it here.
+		if (power_slowed) {
+			__disable_irq();
+
+			if (power_slowed) {
+				usart_arm_wake(NULL);
+				power_wake();
+			}
+
+			__enable_irq();
+		}
+	} else if (power_quiet_ticks && !power_slowed &&
+			(systick_cnt - power_last_active >= power_quiet_ticks)) {
+		__disable_irq();
+
+		clocks_set_divider(power_max_div);
+		power_slowed = true;
+
+		// If a byte came in just now, this runs as soon as
+		// interrupts are back on.
+		usart_arm_wake(power_wake);
+
+		__enable_irq();
+	}
+
+	// Systick, at least, wakes this every 4ms.
+	__WFI();
+}
+
+void power_init(uint32_t quiet_ms, uint32_t baud)
+{
+	power_max_div = clocks_max_divider(baud);
+	power_last_active = systick_cnt;
+
+	if (power_max_div > 1) {
+		power_quiet_ticks = (quiet_ms + 3) / 4;
+	}
+
+	usart_set_idle(power_idle);
+}